@@ -18,6 +18,20 @@ Yes. I've found it to be simpler this way;
 #include <iostream>
 #include <chrono>
 #include <queue>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <cstdint>
+#include <cmath>
+#ifdef USE_PEXT
+#ifndef __BMI2__
+#error "USE_PEXT requires BMI2, compile with -mbmi2"
+#endif
+#endif
+#if defined(USE_PEXT) || defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 using std::cout;
 using std::cin;
 using std::endl;
@@ -74,7 +88,7 @@ struct moves {
     0000 0000 0000 0000 1111 0000 0000 0000    piece               0xf000
     0000 0000 0000 1111 0000 0000 0000 0000    promoted piece      0xf0000
     0000 0000 1111 0000 0000 0000 0000 0000    captured piece      0xf00000
-    0000 1111 0000 0000 0000 0000 0000 0000    castling state      0xf000000
+    0000 1111 0000 0000 0000 0000 0000 0000    unused              0xf000000
     0001 0000 0000 0000 0000 0000 0000 0000    double push flag    0x10000000
     0010 0000 0000 0000 0000 0000 0000 0000    en passant flag     0x20000000
     0100 0000 0000 0000 0000 0000 0000 0000    castling flag       0x40000000
@@ -87,7 +101,6 @@ struct moves {
 #define get_promotion_piece_type(move) ((move & 0xf0000) >> 16)     // Promotion piece type, in case pawn promoted
 #define get_captured_piece_type(move) ((move & 0xf00000) >> 20)     // Piece type of the captured piece, if any
 #define is_capture(move) (((move & 0xf00000) >> 20) != no_piece)    // Helper function returning whether move was a capture
-#define get_castle(move) ((move & 0xf000000) >> 24)                 // Castling state before the move was played
 #define is_double_pawn_push(move) (move & 0x10000000)               // Flag indicating whether move was a double pawn push
 #define is_en_passant(move) (move & 0x20000000)                     // Flag indicating whether move was en passant
 #define is_castling(move) (move & 0x40000000)                       // Flag indicating whether move was castling
@@ -155,8 +168,20 @@ string promotion_position = "4k3/1P4P1/8/8/8/8/1pp3p1/4K3 w - - 0 1";
 string checkmate_position = "rnbqkbnr/ppppp2p/8/8/8/8/PPPP1PPP/RNBQKBNR w KQkq - 0 1";
 string empty_position = "8/k7/8/8/8/8/K7/8 w - - ";
 
-// Arrays for scoring piece placements
-const int P_score[64] = {
+/*
+    Middlegame and endgame scores are packed into a single int, with the endgame score in the upper 16 bits.
+    Packed scores can be added and subtracted as a whole, so both are kept up to date at once.
+*/
+#define make_score(mg, eg) ((int)((unsigned int)(eg) << 16) + (mg))
+#define get_mg_score(score) ((int)(short)(unsigned short)(unsigned int)(score))
+#define get_eg_score(score) ((int)(short)(unsigned short)((unsigned int)((score) + 0x8000) >> 16))
+
+// Game phase contributed by each piece, the phase is max_phase with all pieces on the board and 0 with only pawns and kings left
+const int phase_weight[12] = {0, 1, 1, 2, 4, 0, 0, 1, 1, 2, 4, 0};
+const int max_phase = 24;
+
+// Arrays for scoring white piece placements in the middlegame (black uses the mirrored squares)
+const int P_mg_score[64] = {
     190, 190, 190, 190, 190, 190, 190, 190, 
     130, 130, 130, 140, 140, 130, 130, 130,
     120, 120, 120, 130, 130, 130, 120, 120,
@@ -167,7 +192,7 @@ const int P_score[64] = {
     100, 100, 100, 100, 100, 100, 100, 100
 };
 
-const int N_score[64] = {
+const int N_mg_score[64] = {
     295, 300, 300, 300, 300, 300, 300, 295, 
     295, 300, 300, 310, 310, 300, 300, 295,
     295, 305, 320, 320, 320, 320, 305, 295,
@@ -178,7 +203,7 @@ const int N_score[64] = {
     295, 290, 300, 300, 300, 300, 290, 295
 };
 
-const int B_score[64] = {
+const int B_mg_score[64] = {
     320, 320, 320, 320, 320, 320, 320, 320, 
     320, 320, 320, 320, 320, 320, 320, 320,
     320, 320, 320, 330, 330, 320, 320, 320,
@@ -189,7 +214,7 @@ const int B_score[64] = {
     320, 320, 310, 320, 320, 310, 320, 320
 };
 
-const int R_score[64] = {
+const int R_mg_score[64] = {
     550, 550, 550, 550, 550, 550, 550, 550, 
     550, 550, 550, 550, 550, 550, 550, 550,
     500, 500, 510, 520, 520, 510, 500, 500,
@@ -200,7 +225,7 @@ const int R_score[64] = {
     500, 500, 500, 520, 520, 500, 500, 500
 };
 
-const int Q_score[64] = {
+const int Q_mg_score[64] = {
     1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000,
     1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000,
     1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000,
@@ -211,88 +236,129 @@ const int Q_score[64] = {
     1000, 1000, 1000, 1000, 1000, 1000, 1000, 1000
 };
 
-const int K_score[64] = {
-    10000, 10000, 10000, 10000, 10000, 10000, 10000, 10000, 
-    10000, 10000, 10005, 10005, 10005, 10005, 10000, 10000,
-    10000, 10005, 10005, 10010, 10010, 10005, 10005, 10000,
-    10000, 10005, 10010, 10020, 10020, 10010, 10005, 10000,
-    10000, 10005, 10010, 10020, 10020, 10010, 10005, 10000,
-    10000, 10000, 10005, 10010, 10010, 10005, 10000, 10000,
-    10000, 10005, 10005, 9995, 9995, 10000, 10005, 10000,
-    10000, 10000, 10005, 10000, 9985, 10000, 10010, 10000
+// Both kings are always on the board, so the king tables only hold placement scores
+const int K_mg_score[64] = {
+    0, 0, 0,  0,  0,  0, 0,  0, 
+    0, 0, 5,  5,  5,  5, 0,  0,
+    0, 5, 5,  10, 10, 5, 5,  0,
+    0, 5, 10, 20, 20, 10, 5, 0,
+    0, 5, 10, 20, 20, 10, 5, 0,
+    0, 0, 5,  10, 10, 5, 0,  0,
+    0, 5, 5,  -5, -5, 0, 5,  0,
+    0, 0, 5,  0, -15, 0, 10, 0
 };
 
-const int p_score[64] = {
-    -100, -100, -100, -100, -100, -100, -100, -100, 
-    -100, -100, -100,  -90,  -90, -100, -100, -100,
-    -100, -100, -100, -105, -105, -100, -100, -100,
-    -105, -105, -110, -120, -120, -105, -105, -105,
-    -110, -110, -110, -120, -120, -110, -110, -110,
-    -120, -120, -120, -130, -130, -130, -120, -120,
-    -130, -130, -130, -140, -140, -130, -130, -130,
-    -190, -190, -190, -190, -190, -190, -190, -190
+// Arrays for scoring white piece placements in the endgame, where advanced pawns and active pieces matter most
+const int P_eg_score[64] = {
+    200, 200, 200, 200, 200, 200, 200, 200,
+    200, 200, 200, 200, 200, 200, 200, 200,
+    160, 160, 160, 160, 160, 160, 160, 160,
+    135, 135, 135, 135, 135, 135, 135, 135,
+    120, 120, 120, 120, 120, 120, 120, 120,
+    110, 110, 110, 110, 110, 110, 110, 110,
+    105, 105, 105, 105, 105, 105, 105, 105,
+    100, 100, 100, 100, 100, 100, 100, 100
+};
+
+const int N_eg_score[64] = {
+    250, 260, 270, 270, 270, 270, 260, 250,
+    260, 275, 285, 285, 285, 285, 275, 260,
+    270, 285, 300, 305, 305, 300, 285, 270,
+    270, 285, 305, 310, 310, 305, 285, 270,
+    270, 285, 305, 310, 310, 305, 285, 270,
+    270, 285, 300, 305, 305, 300, 285, 270,
+    260, 275, 285, 285, 285, 285, 275, 260,
+    250, 260, 270, 270, 270, 270, 260, 250
 };
 
-const int n_score[64] = {
-    -295, -290, -300, -300, -300, -300, -290, -295, 
-    -295, -300, -300, -300, -300, -300, -300, -295,
-    -295, -305, -320, -310, -310, -320, -305, -295,
-    -295, -310, -320, -330, -330, -320, -310, -295,
-    -295, -310, -320, -330, -330, -320, -310, -295,
-    -295, -305, -320, -320, -320, -320, -305, -295,
-    -295, -300, -300, -310, -310, -300, -300, -295,
-    -295, -300, -300, -300, -300, -300, -300, -295
+const int B_eg_score[64] = {
+    300, 305, 305, 305, 305, 305, 305, 300,
+    305, 310, 310, 310, 310, 310, 310, 305,
+    305, 310, 315, 315, 315, 315, 310, 305,
+    305, 310, 315, 320, 320, 315, 310, 305,
+    305, 310, 315, 320, 320, 315, 310, 305,
+    305, 310, 315, 315, 315, 315, 310, 305,
+    305, 310, 310, 310, 310, 310, 310, 305,
+    300, 305, 305, 305, 305, 305, 305, 300
 };
 
-const int b_score[64] = {
-    -320, -320, -310, -320, -320, -310, -320, -320, 
-    -320, -350, -320, -320, -320, -320, -350, -320,
-    -320, -330, -320, -320, -320, -320, -330, -320,
-    -320, -320, -330, -340, -340, -330, -320, -320,
-    -320, -320, -330, -340, -340, -330, -320, -320,
-    -320, -320, -320, -330, -330, -320, -320, -320,
-    -320, -320, -320, -320, -320, -320, -320, -320,
-    -320, -320, -320, -320, -320, -320, -320, -320
+const int R_eg_score[64] = {
+    520, 520, 520, 520, 520, 520, 520, 520,
+    530, 530, 530, 530, 530, 530, 530, 530,
+    520, 520, 520, 520, 520, 520, 520, 520,
+    520, 520, 520, 520, 520, 520, 520, 520,
+    520, 520, 520, 520, 520, 520, 520, 520,
+    520, 520, 520, 520, 520, 520, 520, 520,
+    520, 520, 520, 520, 520, 520, 520, 520,
+    520, 520, 520, 520, 520, 520, 520, 520
 };
 
-const int r_score[64] = {
-    -500, -500, -500, -520, -520, -500, -500, -500, 
-    -500, -500, -510, -520, -520, -510, -500, -500,
-    -500, -500, -510, -520, -520, -510, -500, -500,
-    -500, -500, -510, -520, -520, -510, -500, -500,
-    -500, -500, -510, -520, -520, -510, -500, -500,
-    -500, -500, -510, -520, -520, -510, -500, -500, 
-    -550, -550, -550, -550, -550, -550, -550, -550,
-    -550, -550, -550, -550, -550, -550, -550, -550
+const int Q_eg_score[64] = {
+    940, 950, 950, 950, 950, 950, 950, 940,
+    950, 960, 960, 960, 960, 960, 960, 950,
+    950, 960, 970, 970, 970, 970, 960, 950,
+    950, 960, 970, 980, 980, 970, 960, 950,
+    950, 960, 970, 980, 980, 970, 960, 950,
+    950, 960, 970, 970, 970, 970, 960, 950,
+    950, 960, 960, 960, 960, 960, 960, 950,
+    940, 950, 950, 950, 950, 950, 950, 940
 };
 
-const int q_score[64] = {
-    -1000, -1000, -1000, -1000, -1000, -1000, -1000, -1000, 
-    -1000, -1000, -1000, -1000, -1000, -1000, -1000, -1000,
-    -1000, -1000, -1000, -1000, -1000, -1000, -1000, -1000,
-    -1000, -1000, -1000, -1000, -1000, -1000, -1000, -1000,
-    -1000, -1000, -1000, -1000, -1000, -1000, -1000, -1000,
-    -1000, -1000, -1000, -1000, -1000, -1000, -1000, -1000,
-    -1000, -1000, -1000, -1000, -1000, -1000, -1000, -1000,
-    -1000, -1000, -1000, -1000, -1000, -1000, -1000, -1000
+// The king becomes an active piece in the endgame, so it is drawn to the center
+const int K_eg_score[64] = {
+    -50, -40, -30, -20, -20, -30, -40, -50,
+    -30, -20, -10,   0,   0, -10, -20, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  30,  40,  40,  30, -10, -30,
+    -30, -10,  20,  30,  30,  20, -10, -30,
+    -30, -30,   0,   0,   0,   0, -30, -30,
+    -50, -30, -30, -30, -30, -30, -30, -50
 };
 
-const int k_score[64] = {
-    -10000, -10000, -10005, -10000, -9985, -10000, -10010, -10000, 
-    -10000, -10005, -10005, -9995, -9995, -10000, -10005, -10000,
-    -10000, -10000, -10005, -10010, -10010, -10005, -10000, -10000,
-    -10000, -10005, -10010, -10020, -10020, -10010, -10005, -10000,
-    -10000, -10005, -10010, -10020, -10020, -10010, -10005, -10000,
-    -10000, -10005, -10005, -10010, -10010, -10005, -10005, -10000,
-    -10000, -10000, -10005, -10005, -10005, -10005, -10000, -10000,
-    -10000, -10000, -10000, -10000, -10000, -10000, -10000, -10000
+// Bonus for a passed pawn depending on its rank, counted from its own side
+const int passed_pawn_score[8] = {
+    make_score(0, 0), make_score(5, 10), make_score(10, 15), make_score(15, 25),
+    make_score(25, 45), make_score(40, 75), make_score(60, 110), make_score(0, 0)
 };
 
-const int* piece_score[] = {
-    P_score, N_score, B_score, R_score, Q_score, K_score,
-    p_score, n_score, b_score, r_score, q_score, k_score
+// Endgame weight of king proximity to a passed pawn depending on its rank, scaling how much closer
+// the own king is to the square in front of it than the enemy king
+const int passed_pawn_king_weight[8] = {0, 0, 0, 1, 2, 3, 5, 0};
+
+// Penalties for every pawn beyond the first on a file, and for a pawn without friendly pawns on the adjacent files
+const int doubled_pawn_score = make_score(-10, -20);
+const int isolated_pawn_score = make_score(-10, -15);
+
+constexpr const int* mg_scores[] = {P_mg_score, N_mg_score, B_mg_score, R_mg_score, Q_mg_score, K_mg_score};
+constexpr const int* eg_scores[] = {P_eg_score, N_eg_score, B_eg_score, R_eg_score, Q_eg_score, K_eg_score};
+
+// Endgame advantage needed before the mop-up evaluation kicks in
+const int mop_up_margin = 400;
+
+// Packed placement scores for every piece, from white's perspective
+struct piece_score_table {
+    int scores[12][64];
 };
 
+constexpr piece_score_table generate_piece_scores() {
+    piece_score_table table = {};
+
+    for (int piece_type = P; piece_type <= K; piece_type++) {
+        for (int square = 0; square < 64; square++) {
+            table.scores[piece_type][square] = make_score(mg_scores[piece_type][square], eg_scores[piece_type][square]);
+
+            // Black pieces score the vertically mirrored square, negated
+            table.scores[piece_type + 6][square] = -make_score(mg_scores[piece_type][square ^ 56], eg_scores[piece_type][square ^ 56]);
+        }
+    }
+
+    return table;
+}
+
+constexpr piece_score_table piece_score_tables = generate_piece_scores();
+constexpr const int (&piece_score)[12][64] = piece_score_tables.scores;
+
 // Most valuable victim - least valuable attacker [attacker][victim]
 const int mvv_lva[12][12] = {
  	105, 205, 305, 405, 505, 605,  105, 205, 305, 405, 505, 605,
@@ -310,6 +376,9 @@ const int mvv_lva[12][12] = {
 	100, 200, 300, 400, 500, 600,  100, 200, 300, 400, 500, 600
 };
 
+// Piece values used by the static exchange evaluation, where the king is worth more than all other pieces together
+const int see_value[12] = {100, 300, 300, 500, 900, 20000, 100, 300, 300, 500, 900, 20000};
+
 // Castling rights update constants
 const int castling_rights[64] = {
     7, 15, 15, 15, 3, 15, 15, 11,
@@ -322,21 +391,22 @@ const int castling_rights[64] = {
     13, 15, 15, 15, 12, 15, 15, 14};
 
 // Class to measure time for various purposes
+// Uses the steady clock, which is monotonic and cheap to read, unlike the system clock
 class Timer {
 private:
-    std::chrono::time_point<std::chrono::high_resolution_clock> start_time;
+    std::chrono::time_point<std::chrono::steady_clock> start_time;
 
 public:
     Timer() {
-        start_time = std::chrono::high_resolution_clock::now();
+        start_time = std::chrono::steady_clock::now();
     }
 
     void reset() {
-        start_time = std::chrono::high_resolution_clock::now();
+        start_time = std::chrono::steady_clock::now();
     }
 
     double get_time_passed_millis() {
-        auto current_time = std::chrono::high_resolution_clock::now();
+        auto current_time = std::chrono::steady_clock::now();
         return std::chrono::duration_cast<std::chrono::milliseconds>(current_time - start_time).count();
     }
 };
@@ -373,14 +443,44 @@ namespace rng {
         // Slices them all together
         return n1 | (n2 << 16) | (n3 << 32) | (n4 << 48);
     }
+
+    U64 random_state_64 = 0x9e3779b97f4a7c15ULL;
+
+    // Generates a random 64-bit number from a full 64-bit state (xorshift64*)
+    // The numbers from generate_64_bit all stem from a 32-bit state, so sets of them
+    // easily XOR to the same value, which makes them unsuitable as Zobrist keys
+    U64 generate_64_bit_key() {
+        random_state_64 ^= random_state_64 >> 12;
+        random_state_64 ^= random_state_64 << 25;
+        random_state_64 ^= random_state_64 >> 27;
+
+        return random_state_64 * 0x2545f4914f6cdd1dULL;
+    }
 }
 
 /*
-    The rng namespace contains utility functions used in various places for various purposes.
+    The util namespace contains utility functions used in various places for various purposes.
+
+    The bit operations use compiler builtins where available, which become single POPCNT/TZCNT
+    instructions when compiled with -mpopcnt -mbmi (see the makefile), and the native i64.popcnt
+    and i64.ctz instructions in WebAssembly. Other compilers fall back to portable versions.
 */
 namespace util {
+#if !defined(__GNUC__) && !defined(__clang__)
+    // Index of the least significant bit of an isolated bit, using a De Bruijn sequence
+    const int de_bruijn_index[64] = {
+        0, 1, 48, 2, 57, 49, 28, 3, 61, 58, 50, 42, 38, 29, 17, 4,
+        62, 55, 59, 36, 53, 51, 43, 22, 45, 39, 33, 30, 24, 18, 12, 5,
+        63, 47, 56, 27, 60, 41, 37, 16, 54, 35, 52, 21, 44, 32, 23, 11,
+        46, 26, 40, 15, 34, 20, 31, 10, 25, 14, 19, 9, 13, 8, 7, 6
+    };
+#endif
+
     // Counts the amount of bits (1's) in a given bitboard
-    static inline int count_bits(U64 bitboard) {
+    static constexpr inline int count_bits(U64 bitboard) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_popcountll(bitboard);
+#else
         int count = 0;
 
         while (bitboard) {
@@ -389,33 +489,582 @@ namespace util {
         }
 
         return count;
+#endif
     }
 
-    // Returns the least significant first bit in a bitboard (going from the top left corner)
-    // The bitboard returned consists of 1's until the first 1 in the given bitboard is found
-    static inline int get_ls1b(U64 bitboard) {
-        return (count_bits((bitboard & -bitboard) - 1));
+    // Returns the index of the least significant first bit in a bitboard (going from the top left corner)
+    // An empty bitboard returns 64
+    static constexpr inline int get_ls1b(U64 bitboard) {
+#if defined(__GNUC__) || defined(__clang__)
+        return bitboard ? __builtin_ctzll(bitboard) : 64;
+#else
+        return bitboard ? de_bruijn_index[((bitboard & -bitboard) * 0x03f79d71b4cb0a89ULL) >> 58] : 64;
+#endif
     }
 }
 
 /*
     The state namespace contains all necessary information about the game state.
+    Every search thread works on its own copy of the state, hence thread_local.
 */
 namespace state {
     // Piece bitboards
-    U64 bitboards[12];
+    thread_local U64 bitboards[12];
 
     // Occupancy bitboards
-    U64 occupancies[3];
+    thread_local U64 occupancies[3];
 
     // Side to move
-    int side = -1;
+    thread_local int side = -1;
 
     // En passant square
-    int en_passant = no_sq;
+    thread_local int en_passant = no_sq;
 
     // Castling rights
-    int castle = 0;
+    thread_local int castle = 0;
+
+    // Zobrist key uniquely (in practice) identifying the current position
+    thread_local U64 hash_key = 0ULL;
+
+    // Zobrist key of the pawns alone, used to look up the pawn structure evaluation
+    thread_local U64 pawn_key = 0ULL;
+
+    // Piece on every square (no_piece if empty), kept in sync with the bitboards
+    thread_local char board[64];
+
+    // Sum of the packed material and placement scores of all pieces, from white's perspective
+    thread_local int score = 0;
+
+    // Game phase, see max_phase
+    thread_local int phase = 0;
+
+    // Half-moves since the last capture or pawn move, for the fifty-move rule and to limit the repetition search
+    thread_local int halfmove_clock = 0;
+
+    // Starts at 1 and is incremented after every black move
+    thread_local int fullmove_number = 1;
+
+    // The parts of the state a move cannot restore by itself (the captured piece is part of the move)
+    struct undo_info {
+        int castle;
+        int en_passant;
+        int score;
+        int phase;
+        int halfmove_clock;
+        U64 hash_key;
+        U64 pawn_key;
+    };
+
+    // Stack with a record for every move made since the position was set up, popped again when unmaking
+    // The hash keys in it make up the history of positions, both of the game and of the current search line
+    const int max_undo_size = 2048;
+    thread_local undo_info undo_stack[max_undo_size];
+    thread_local int undo_size = 0;
+
+    // Copy of the full state, used to hand a position over to another thread
+    struct snapshot {
+        U64 bitboards[12];
+        U64 occupancies[3];
+        char board[64];
+        int side;
+        int en_passant;
+        int castle;
+        int score;
+        int phase;
+        int halfmove_clock;
+        int fullmove_number;
+        U64 hash_key;
+        U64 pawn_key;
+
+        // Keys of the positions since the last capture or pawn move, oldest first, to detect repetitions
+        int history_size;
+        U64 key_history[max_undo_size];
+    };
+
+    snapshot save() {
+        snapshot board;
+        memcpy(board.bitboards, bitboards, sizeof(bitboards));
+        memcpy(board.occupancies, occupancies, sizeof(occupancies));
+        memcpy(board.board, state::board, sizeof(state::board));
+        board.side = side;
+        board.en_passant = en_passant;
+        board.castle = castle;
+        board.score = score;
+        board.phase = phase;
+        board.halfmove_clock = halfmove_clock;
+        board.fullmove_number = fullmove_number;
+        board.hash_key = hash_key;
+        board.pawn_key = pawn_key;
+        board.history_size = std::min(halfmove_clock, undo_size);
+        for (int i = 0; i < board.history_size; i++) {
+            board.key_history[i] = undo_stack[undo_size - board.history_size + i].hash_key;
+        }
+        return board;
+    }
+
+    void load(const snapshot &board) {
+        memcpy(bitboards, board.bitboards, sizeof(bitboards));
+        memcpy(occupancies, board.occupancies, sizeof(occupancies));
+        memcpy(state::board, board.board, sizeof(state::board));
+        side = board.side;
+        en_passant = board.en_passant;
+        castle = board.castle;
+        score = board.score;
+        phase = board.phase;
+        halfmove_clock = board.halfmove_clock;
+        fullmove_number = board.fullmove_number;
+        hash_key = board.hash_key;
+        pawn_key = board.pawn_key;
+
+        // Only the keys of the history are needed, as moves before the snapshot are never unmade
+        undo_size = board.history_size;
+        for (int i = 0; i < board.history_size; i++) {
+            undo_stack[i].hash_key = board.key_history[i];
+        }
+    }
+}
+
+/*
+    The hashing namespace contains the Zobrist keys used to identify positions,
+    as well as the transposition table used to store previously searched positions.
+*/
+namespace hashing {
+    // Random keys for every piece on every square, en passant square, castling state and side
+    U64 piece_keys[12][64];
+    U64 en_passant_keys[64];
+    U64 castle_keys[16];
+    U64 side_key;
+
+    // Flags describing how the stored score relates to the true score
+    enum {hash_exact, hash_alpha, hash_beta};
+
+    // Returned when no usable entry was found in the transposition table
+    const int no_hash_entry = 100000;
+
+    // Scores beyond this bound are mate scores, which depend on the ply they were found at
+    const int mate_bound = 48000;
+
+    // Default and maximum size, in megabytes, of the transposition table
+    const int default_hash_size = 16;
+    const int max_hash_size = 1024;
+
+    /*
+        The table is shared between all search threads without any locking.
+        Depth, flag, score and best move are packed into a single 64-bit data word,
+        and the key is stored XOR'ed with that word. An entry torn by two threads
+        writing at once therefore fails the key check instead of being misread.
+
+              Data bits                                   Mask
+
+        bits  0-30    best move                           0x7fffffff
+        bits 31-47    score (offset by score_offset)      0x1ffff
+        bits 48-55    depth                               0xff
+        bits 56-57    flag                                0x3
+    */
+    struct entry {
+        std::atomic<U64> key;
+        std::atomic<U64> data;
+    };
+
+    // Added to scores before packing, so that they are never negative
+    const int score_offset = 65536;
+
+    // The transposition table itself, its size is configurable with "setoption name Hash"
+    entry *table = nullptr;
+    U64 table_size = 0;
+
+    // Cached evaluation of a pawn structure, along with its passed pawns
+    struct pawn_entry {
+        U64 key;
+        int score;
+        U64 passed_pawns;
+    };
+
+    /*
+        The pawn structure rarely changes between nodes, so its evaluation is cached by pawn key.
+        Every search thread has its own small table, so no synchronization is needed.
+        An empty entry has key 0, which is also the key of (and correct for) a board without pawns.
+    */
+    const int pawn_table_size = 8192;
+    thread_local pawn_entry pawn_table[pawn_table_size];
+
+    // Generates the random keys
+    void init_keys() {
+        for (int piece_type = P; piece_type <= k; piece_type++) {
+            for (int square = 0; square < 64; square++) {
+                piece_keys[piece_type][square] = rng::generate_64_bit_key();
+            }
+        }
+
+        for (int square = 0; square < 64; square++) {
+            en_passant_keys[square] = rng::generate_64_bit_key();
+        }
+
+        for (int castle = 0; castle < 16; castle++) {
+            castle_keys[castle] = rng::generate_64_bit_key();
+        }
+
+        side_key = rng::generate_64_bit_key();
+    }
+
+    // Empties the transposition table without resizing it
+    void clear_table() {
+        for (U64 i = 0; i < table_size; i++) {
+            table[i].key.store(0ULL, std::memory_order_relaxed);
+            table[i].data.store(0ULL, std::memory_order_relaxed);
+        }
+    }
+
+    // Resizes the transposition table to the given amount of megabytes
+    void resize_table(int megabytes) {
+        if (megabytes < 1) megabytes = 1;
+        if (megabytes > max_hash_size) megabytes = max_hash_size;
+
+        delete[] table;
+        table_size = (U64)megabytes * 1024 * 1024 / sizeof(entry);
+        table = new entry[table_size];
+        clear_table();
+    }
+
+    // Performs complete setup
+    void init() {
+        init_keys();
+        resize_table(default_hash_size);
+    }
+
+    // Generates the key of the current position from scratch
+    U64 generate_key() {
+        U64 key = 0ULL;
+
+        for (int piece_type = P; piece_type <= k; piece_type++) {
+            U64 bitboard = state::bitboards[piece_type];
+
+            while (bitboard) {
+                int square = util::get_ls1b(bitboard);
+                key ^= piece_keys[piece_type][square];
+                pop_bit(bitboard, square);
+            }
+        }
+
+        if (state::en_passant != no_sq) {
+            key ^= en_passant_keys[state::en_passant];
+        }
+
+        key ^= castle_keys[state::castle];
+
+        if (state::side == black) {
+            key ^= side_key;
+        }
+
+        return key;
+    }
+
+    // Generates the pawn key of the current position from scratch
+    U64 generate_pawn_key() {
+        U64 key = 0ULL;
+
+        for (int piece_type : {P, p}) {
+            U64 bitboard = state::bitboards[piece_type];
+
+            while (bitboard) {
+                int square = util::get_ls1b(bitboard);
+                key ^= piece_keys[piece_type][square];
+                pop_bit(bitboard, square);
+            }
+        }
+
+        return key;
+    }
+
+    // Looks up the current position, returning a usable score or no_hash_entry
+    // The best move is returned regardless, so it can be used for move ordering
+    static inline int read_entry(int alpha, int beta, int depth, int ply, int *best_move) {
+        entry *hash_entry = &table[state::hash_key % table_size];
+
+        U64 data = hash_entry->data.load(std::memory_order_relaxed);
+
+        if ((hash_entry->key.load(std::memory_order_relaxed) ^ data) != state::hash_key) {
+            return no_hash_entry;
+        }
+
+        *best_move = data & 0x7fffffff;
+
+        if ((int)((data >> 48) & 0xff) >= depth) {
+            int score = (int)((data >> 31) & 0x1ffff) - score_offset;
+            int flag = (data >> 56) & 0x3;
+
+            // Mate scores are stored relative to the node, but used relative to the root
+            if (score < -mate_bound) score += ply;
+            if (score > mate_bound) score -= ply;
+
+            if (flag == hash_exact) {
+                return score;
+            }
+            if (flag == hash_alpha && score <= alpha) {
+                return alpha;
+            }
+            if (flag == hash_beta && score >= beta) {
+                return beta;
+            }
+        }
+
+        return no_hash_entry;
+    }
+
+    // Stores the current position, replacing whatever was in its slot
+    static inline void write_entry(int score, int depth, int flag, int ply, int best_move) {
+        entry *hash_entry = &table[state::hash_key % table_size];
+
+        if (score < -mate_bound) score -= ply;
+        if (score > mate_bound) score += ply;
+
+        U64 data = ((U64)best_move & 0x7fffffff) |
+            ((U64)(score + score_offset) << 31) |
+            ((U64)(depth & 0xff) << 48) |
+            ((U64)flag << 56);
+
+        hash_entry->key.store(state::hash_key ^ data, std::memory_order_relaxed);
+        hash_entry->data.store(data, std::memory_order_relaxed);
+    }
+}
+
+/*
+    The nnue namespace contains the optional neural network evaluation (NNUE), used instead of
+    the piece-square evaluation once a weights file is loaded and UseNNUE is enabled.
+
+    The network has 768 inputs, one for every piece type on every square, seen from both sides' perspectives.
+    Each perspective has its own hidden layer of hidden_size neurons (sharing weights), which are clipped
+    to [0, QA] and combined into a single output, with the side to move's neurons coming first.
+
+    The hidden layer values before clipping (the accumulator) only change by a few weight columns per move,
+    so make_move updates them incrementally instead of computing them from scratch for every evaluation.
+
+    The weights file consists of little-endian 16-bit integers, in the following order:
+        feature weights     [768][hidden_size]      quantized by QA
+        feature biases      [hidden_size]           quantized by QA
+        output weights      [2][hidden_size]        quantized by QB
+        output bias                                 quantized by QA * QB
+*/
+namespace nnue {
+    const int input_size = 768;
+    const int hidden_size = 256;
+
+    // Quantization factors of the weights and the factor scaling the output to centipawns
+    const int QA = 255;
+    const int QB = 64;
+    const int eval_scale = 400;
+
+    alignas(32) int16_t feature_weights[input_size * hidden_size];
+    alignas(32) int16_t feature_biases[hidden_size];
+    alignas(32) int16_t output_weights[2 * hidden_size];
+    int16_t output_bias;
+
+    // Whether a network is loaded, and whether it is used for evaluation
+    bool loaded = false;
+    bool enabled = false;
+
+    // Hidden layer values before clipping, from white's and black's perspective
+    struct accumulator {
+        alignas(32) int16_t values[2][hidden_size];
+    };
+
+    /*
+        There is an accumulator for every entry in the undo stack, so unmaking a move simply goes back to the previous one.
+        The stack wraps around, which is fine as long as searches stay shallower than its size,
+        since the root accumulator is computed from scratch whenever a search starts from a new position.
+    */
+    const int accumulator_stack_size = 256;
+    thread_local accumulator accumulators[accumulator_stack_size];
+
+    static inline accumulator &current_accumulator() {
+        return accumulators[state::undo_size % accumulator_stack_size];
+    }
+
+    // Returns the input of a piece on a square from one side's perspective
+    // Each side sees the board from its own first rank, with its own pieces first
+    static inline int feature_index(int perspective, int piece, int square) {
+        return perspective == white ? piece * 64 + (square ^ 56) : ((piece + 6) % 12) * 64 + square;
+    }
+
+    /*
+        The following kernels add or subtract a weight column to an accumulator, and
+        compute the clipped dot product with the output weights. They use AVX2 or SSE4.1
+        when compiled with -mavx2 or -msse4.1, and plain loops otherwise (like in the WebAssembly build).
+    */
+    static inline void add_weights(int16_t *values, const int16_t *weights) {
+#if defined(__AVX2__)
+        for (int i = 0; i < hidden_size; i += 16) {
+            __m256i sum = _mm256_add_epi16(_mm256_load_si256((const __m256i *)(values + i)), _mm256_load_si256((const __m256i *)(weights + i)));
+            _mm256_store_si256((__m256i *)(values + i), sum);
+        }
+#elif defined(__SSE4_1__)
+        for (int i = 0; i < hidden_size; i += 8) {
+            __m128i sum = _mm_add_epi16(_mm_load_si128((const __m128i *)(values + i)), _mm_load_si128((const __m128i *)(weights + i)));
+            _mm_store_si128((__m128i *)(values + i), sum);
+        }
+#else
+        for (int i = 0; i < hidden_size; i++) {
+            values[i] += weights[i];
+        }
+#endif
+    }
+
+    static inline void subtract_weights(int16_t *values, const int16_t *weights) {
+#if defined(__AVX2__)
+        for (int i = 0; i < hidden_size; i += 16) {
+            __m256i difference = _mm256_sub_epi16(_mm256_load_si256((const __m256i *)(values + i)), _mm256_load_si256((const __m256i *)(weights + i)));
+            _mm256_store_si256((__m256i *)(values + i), difference);
+        }
+#elif defined(__SSE4_1__)
+        for (int i = 0; i < hidden_size; i += 8) {
+            __m128i difference = _mm_sub_epi16(_mm_load_si128((const __m128i *)(values + i)), _mm_load_si128((const __m128i *)(weights + i)));
+            _mm_store_si128((__m128i *)(values + i), difference);
+        }
+#else
+        for (int i = 0; i < hidden_size; i++) {
+            values[i] -= weights[i];
+        }
+#endif
+    }
+
+    static inline int clipped_dot_product(const int16_t *values, const int16_t *weights) {
+#if defined(__AVX2__)
+        __m256i min = _mm256_setzero_si256();
+        __m256i max = _mm256_set1_epi16(QA);
+        __m256i sum = _mm256_setzero_si256();
+
+        for (int i = 0; i < hidden_size; i += 16) {
+            __m256i clipped = _mm256_min_epi16(_mm256_max_epi16(_mm256_load_si256((const __m256i *)(values + i)), min), max);
+            sum = _mm256_add_epi32(sum, _mm256_madd_epi16(clipped, _mm256_load_si256((const __m256i *)(weights + i))));
+        }
+
+        __m128i half_sum = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+        half_sum = _mm_hadd_epi32(half_sum, half_sum);
+        half_sum = _mm_hadd_epi32(half_sum, half_sum);
+        return _mm_cvtsi128_si32(half_sum);
+#elif defined(__SSE4_1__)
+        __m128i min = _mm_setzero_si128();
+        __m128i max = _mm_set1_epi16(QA);
+        __m128i sum = _mm_setzero_si128();
+
+        for (int i = 0; i < hidden_size; i += 8) {
+            __m128i clipped = _mm_min_epi16(_mm_max_epi16(_mm_load_si128((const __m128i *)(values + i)), min), max);
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(clipped, _mm_load_si128((const __m128i *)(weights + i))));
+        }
+
+        sum = _mm_hadd_epi32(sum, sum);
+        sum = _mm_hadd_epi32(sum, sum);
+        return _mm_cvtsi128_si32(sum);
+#else
+        int sum = 0;
+
+        for (int i = 0; i < hidden_size; i++) {
+            sum += std::min(std::max((int)values[i], 0), QA) * weights[i];
+        }
+
+        return sum;
+#endif
+    }
+
+    // Adds or removes a piece on a square in both perspectives of an accumulator
+    static inline void add_piece(accumulator &acc, int piece, int square) {
+        add_weights(acc.values[white], &feature_weights[feature_index(white, piece, square) * hidden_size]);
+        add_weights(acc.values[black], &feature_weights[feature_index(black, piece, square) * hidden_size]);
+    }
+
+    static inline void remove_piece(accumulator &acc, int piece, int square) {
+        subtract_weights(acc.values[white], &feature_weights[feature_index(white, piece, square) * hidden_size]);
+        subtract_weights(acc.values[black], &feature_weights[feature_index(black, piece, square) * hidden_size]);
+    }
+
+    // Computes the accumulator of the current position from scratch
+    void refresh() {
+        if (!enabled) {
+            return;
+        }
+
+        accumulator &acc = current_accumulator();
+        memcpy(acc.values[white], feature_biases, sizeof(feature_biases));
+        memcpy(acc.values[black], feature_biases, sizeof(feature_biases));
+
+        for (int piece_type = P; piece_type <= k; piece_type++) {
+            U64 bitboard = state::bitboards[piece_type];
+
+            while (bitboard) {
+                int square = util::get_ls1b(bitboard);
+                pop_bit(bitboard, square);
+                add_piece(acc, piece_type, square);
+            }
+        }
+    }
+
+    // Computes the accumulator after a move from the one before it
+    // Called by make_move once the move is on the undo stack
+    static inline void update(int move, int side) {
+        accumulator &acc = current_accumulator();
+        acc = accumulators[(state::undo_size - 1) % accumulator_stack_size];
+
+        int source = get_source(move);
+        int target = get_target(move);
+        int piece = get_piece(move);
+        int promotion_piece_type = get_promotion_piece_type(move);
+
+        remove_piece(acc, piece, source);
+        add_piece(acc, promotion_piece_type ? promotion_piece_type : piece, target);
+
+        if (is_en_passant(move)) {
+            remove_piece(acc, side == white ? p : P, side == white ? target + 8 : target - 8);
+        }
+        else if (is_capture(move)) {
+            remove_piece(acc, get_captured_piece_type(move), target);
+        }
+        else if (is_castling(move)) {
+            int rook_piece = (side == white ? R : r);
+
+            switch (target) {
+                case g1: remove_piece(acc, rook_piece, h1); add_piece(acc, rook_piece, f1); break;
+                case c1: remove_piece(acc, rook_piece, a1); add_piece(acc, rook_piece, d1); break;
+                case g8: remove_piece(acc, rook_piece, h8); add_piece(acc, rook_piece, f8); break;
+                case c8: remove_piece(acc, rook_piece, a8); add_piece(acc, rook_piece, d8); break;
+            }
+        }
+    }
+
+    // Carries the accumulator over to a null move, which changes no pieces
+    static inline void update_null_move() {
+        current_accumulator() = accumulators[(state::undo_size - 1) % accumulator_stack_size];
+    }
+
+    // Evaluates the current position from the perspective of the side to move
+    static inline int evaluate(int side) {
+        const accumulator &acc = current_accumulator();
+
+        int output = clipped_dot_product(acc.values[side], output_weights) +
+            clipped_dot_product(acc.values[side ^ 1], output_weights + hidden_size) +
+            output_bias;
+
+        // Keeps the evaluation clear of mate scores
+        return std::max(-hashing::mate_bound + 1, std::min(hashing::mate_bound - 1, output * eval_scale / (QA * QB)));
+    }
+
+    // Loads a network from a weights file, returning whether it succeeded
+    bool load(const string &path) {
+        std::ifstream file(path, std::ios::binary);
+
+        file.read((char *)feature_weights, sizeof(feature_weights));
+        file.read((char *)feature_biases, sizeof(feature_biases));
+        file.read((char *)output_weights, sizeof(output_weights));
+        file.read((char *)&output_bias, sizeof(output_bias));
+
+        loaded = (bool)file;
+        if (!loaded) {
+            enabled = false;
+        }
+
+        refresh();
+
+        return loaded;
+    }
 }
 
 /*
@@ -441,19 +1090,20 @@ namespace format {
             char(promoted_pieces[get_promotion_piece_type(move)]);
     }
 
+    // Same as move, without the trailing space of moves that don't promote
+    string trimmed_move(int move_code) {
+        string move_string = move(move_code);
+        if (move_string.back() == ' ') move_string.pop_back();
+        return move_string;
+    }
+
     string game_fen() {
         string fen_string = "";
         for (size_t i = 0; i < 8; i++) {
             int num_empty_squares = 0;
             for (size_t j = 0; j < 8; j++) {
                 int square = i * 8 + j;
-                int found_piece = no_piece;
-                for (size_t piece_type = P; piece_type <= k; piece_type++) {
-                    if (get_bit(state::bitboards[piece_type], square)) {
-                        found_piece = piece_type;
-                        break;
-                    }
-                }
+                int found_piece = state::board[square];
                 if (found_piece != no_piece) {
                     if (num_empty_squares != 0) {
                         fen_string += std::to_string(num_empty_squares);
@@ -505,7 +1155,8 @@ namespace format {
             fen_string += "-";
         }
 
-        // Note: Halfmove clock and Fullmove counter are not implemented!
+        // Halfmove clock and fullmove number
+        fen_string += " " + std::to_string(state::halfmove_clock) + " " + std::to_string(state::fullmove_number);
 
         return fen_string;
     }
@@ -517,10 +1168,12 @@ namespace format {
 namespace flags {
     bool verbose = false; // -v
     bool debug = false;   // -d
+    bool bench = false;   // -b
 
     void show_help() {
         cout << "Usage: JuulesPlusPlus [Options]"      << endl;
         cout << "Options:"                             << endl;
+        cout << "    -b           Run the benchmark"      << endl;
         cout << "    -d           Enable debug mode"      << endl;
         cout << "    -v           Enable verbose mode"    << endl;
         cout << "    -h           Show this help message" << endl;
@@ -528,7 +1181,10 @@ namespace flags {
 
     void init(int argc, char* argv[]) {
         for (int i = 1; i < argc; ++i) {
-            if (strcmp(argv[i], "-d") == 0) {
+            if (strcmp(argv[i], "-b") == 0) {
+                bench = true;
+            }
+            else if (strcmp(argv[i], "-d") == 0) {
                 debug = true;
             } 
             else if (strcmp(argv[i], "-v") == 0) {
@@ -555,18 +1211,12 @@ namespace flags {
 
 /*
     The move_gen namespace contains useful functions and variables related to the move generation process.
-    This includes initialization functions as well as functions for generating all available moves.
+    This includes the compile-time generation of attack tables as well as functions for generating all available moves.
 */
 namespace move_gen {
-    // Empty attack arrays for the different pieces (pawns is 2d to account for color)
-    U64 pawn_attacks[2][64];
-    U64 pawn_quiet_moves[2][64];
-    U64 knight_moves[64];
-    U64 king_moves[64];
-    U64 rook_masks[64];
-    U64 bishop_masks[64];
-    U64 rook_attacks[64][4096];
-    U64 bishop_attacks[64][512];
+    // Rook and bishop attacks are packed into one array, where every square of each slider
+    // owns 2^relevant_bits entries from its offset on (102400 for rooks, 5248 for bishops)
+    const int slider_attacks_size = 107648;
 
     // Amount of legal moves bishop/rook can make from square index
     const int bishop_relevant_bits[] = {
@@ -727,11 +1377,14 @@ namespace move_gen {
     const U64 not_ab = 18229723555195321596ULL;
     const U64 not_h = 9187201950435737471ULL;
     const U64 not_gh = 4557430888798830399ULL;
+    const U64 rank_1 = 18374686479671623680ULL;
     const U64 rank_2 = 71776119061217280ULL;
     const U64 rank_7 = 65280ULL;
+    const U64 rank_8 = 255ULL;
+    const U64 file_a = 72340172838076673ULL;
 
     // Returns a bitboard of pawn attacks depending on side
-    U64 mask_pawn_attacks(bool side, int square) {
+    constexpr U64 mask_pawn_attacks(bool side, int square) {
         // Initializes empty bitboard
         U64 attacks = 0ULL;
 
@@ -759,7 +1412,7 @@ namespace move_gen {
         return attacks;
     }
 
-    U64 mask_pawn_quiet_moves(bool side, int square) {
+    constexpr U64 mask_pawn_quiet_moves(bool side, int square) {
 
         U64 moves = 0ULL;
         U64 bitboard = 1ULL << square;
@@ -782,8 +1435,27 @@ namespace move_gen {
         return moves;
     }
 
+    // Returns the squares in front of a pawn, on its own and adjacent files,
+    // which must be free of enemy pawns for the pawn to be passed
+    constexpr U64 mask_passed_pawn(bool side, int square) {
+        U64 mask = 0ULL;
+
+        int tr = square / 8;
+        int tf = square % 8;
+
+        for (int r = (side == white ? tr - 1 : tr + 1); r >= 0 && r < 8; r += (side == white ? -1 : 1)) {
+            for (int f = tf - 1; f <= tf + 1; f++) {
+                if (f >= 0 && f < 8) {
+                    mask |= 1ULL << (r * 8 + f);
+                }
+            }
+        }
+
+        return mask;
+    }
+
     // Returns a knight attack mask
-    U64 mask_knight_moves(int square) {
+    constexpr U64 mask_knight_moves(int square) {
         U64 attacks = 0ULL;
         U64 bitboard = 1ULL << square;
 
@@ -809,7 +1481,7 @@ namespace move_gen {
     }
 
     // Returns a king attack mask
-    U64 mask_king_moves(int square) {
+    constexpr U64 mask_king_moves(int square) {
         U64 attacks = 0ULL;
         U64 bitboard = 1ULL << square;
 
@@ -830,12 +1502,11 @@ namespace move_gen {
     }
 
     // Returns a bishop attack mask
-    U64 mask_bishop_attacks(int square) {
+    constexpr U64 mask_bishop_attacks(int square) {
         U64 attacks = 0ULL;
 
-        int tr, tf;
-        tr = square / 8;
-        tf = square % 8;
+        int tr = square / 8;
+        int tf = square % 8;
 
         // Goes in each direction until board edge is found
         for (int r = tr + 1, f = tf + 1; r < 7 && f < 7; r++, f++)
@@ -851,12 +1522,11 @@ namespace move_gen {
     }
 
     // Returns a rook attack mask
-    U64 mask_rook_attacks(int square) {
+    constexpr U64 mask_rook_attacks(int square) {
         U64 attacks = 0ULL;
 
-        int tr, tf;
-        tr = square / 8;
-        tf = square % 8;
+        int tr = square / 8;
+        int tf = square % 8;
 
         // Goes in each direction until board edge is found
         for (int r = tr + 1; r < 7; r++)
@@ -872,7 +1542,7 @@ namespace move_gen {
     }
 
     // Returns bishop moves depending on blocker bitboard
-    U64 bishop_moves_on_the_fly(int square, U64 blockers) {
+    constexpr U64 bishop_moves_on_the_fly(int square, U64 blockers) {
         U64 attacks = 0ULL;
 
         int tr = square / 8;
@@ -904,7 +1574,7 @@ namespace move_gen {
     }
 
     // Returns rook moves depending on blocker bitboard
-    U64 rook_moves_on_the_fly(int square, U64 blockers) {
+    constexpr U64 rook_moves_on_the_fly(int square, U64 blockers) {
         U64 attacks = 0ULL;
 
         int tr = square / 8;
@@ -936,7 +1606,7 @@ namespace move_gen {
     }
 
     // Generates the appropriate bitboard from a permutation and attack_mask
-    U64 set_occupancy(int permutation, int num_bits, U64 attack_mask) {
+    constexpr U64 set_occupancy(int permutation, int num_bits, U64 attack_mask) {
         U64 occupancy = 0ULL;
         for (int count = 0; count < num_bits; count++) {
             int square = util::get_ls1b(attack_mask);
@@ -947,55 +1617,151 @@ namespace move_gen {
         return occupancy;
     }
 
-    // Initializes the different leaper moves
-    void init_leaper_moves() {
+    // Every attack table the move generator looks up
+    struct attack_tables {
+        U64 pawn_attacks[2][64];
+        U64 pawn_quiet_moves[2][64];
+        U64 passed_pawn_masks[2][64];
+        U64 knight_moves[64];
+        U64 king_moves[64];
+        U64 rook_masks[64];
+        U64 bishop_masks[64];
+        int rook_offsets[64];
+        int bishop_offsets[64];
+        U64 slider_attacks[slider_attacks_size];
+
+        // Squares strictly between two squares sharing a rank, file or diagonal (empty otherwise)
+        U64 between[64][64];
+    };
+
+    // Fills the attack of every occupancy permutation of a slider into the packed attack array
+    constexpr void fill_slider_attacks(attack_tables &tables, bool bishop) {
         for (int square = 0; square < 64; square++) {
-            pawn_attacks[white][square] = mask_pawn_attacks(white, square);
-            pawn_quiet_moves[white][square] = mask_pawn_quiet_moves(white, square);
-            pawn_attacks[black][square] = mask_pawn_attacks(black, square);
-            pawn_quiet_moves[black][square] = mask_pawn_quiet_moves(black, square);
-            knight_moves[square] = mask_knight_moves(square);
-            king_moves[square] = mask_king_moves(square);
+            U64 attack_mask = bishop ? tables.bishop_masks[square] : tables.rook_masks[square];
+            int relevant_bits = bishop ? bishop_relevant_bits[square] : rook_relevant_bits[square];
+            U64 magic_number = bishop ? bishop_magic_numbers[square] : rook_magic_numbers[square];
+            int offset = bishop ? tables.bishop_offsets[square] : tables.rook_offsets[square];
+
+            // Walks every subset of the mask in the same order as set_occupancy (Carry-Rippler trick),
+            // which keeps the compile-time evaluation cheap
+            U64 occupancy = 0ULL;
+
+            for (int i = 0; i < 1 << relevant_bits; i++, occupancy = (occupancy - attack_mask) & attack_mask) {
+#ifdef USE_PEXT
+                // PEXT of the i'th occupancy permutation over the mask is simply i
+                int index = offset + i;
+#else
+                int index = offset + (int)((occupancy * magic_number) >> (64 - relevant_bits));
+#endif
+
+                tables.slider_attacks[index] = bishop ? bishop_moves_on_the_fly(square, occupancy) : rook_moves_on_the_fly(square, occupancy);
+            }
         }
     }
 
-    // Initializes the different slider moves
-    void init_slider_moves(bool bishop) {
+    // Generates all attack tables
+    constexpr attack_tables generate_attack_tables() {
+        attack_tables tables = {};
+
+        // Leaper moves
         for (int square = 0; square < 64; square++) {
-            bishop_masks[square] = mask_bishop_attacks(square);
-            rook_masks[square] = mask_rook_attacks(square);
+            tables.pawn_attacks[white][square] = mask_pawn_attacks(white, square);
+            tables.pawn_quiet_moves[white][square] = mask_pawn_quiet_moves(white, square);
+            tables.pawn_attacks[black][square] = mask_pawn_attacks(black, square);
+            tables.pawn_quiet_moves[black][square] = mask_pawn_quiet_moves(black, square);
+            tables.passed_pawn_masks[white][square] = mask_passed_pawn(white, square);
+            tables.passed_pawn_masks[black][square] = mask_passed_pawn(black, square);
+            tables.knight_moves[square] = mask_knight_moves(square);
+            tables.king_moves[square] = mask_king_moves(square);
+        }
 
-            U64 attack_mask = bishop ? bishop_masks[square] : rook_masks[square];
+        // Slider masks and where each square's attacks start in the packed attack array
+        int offset = 0;
 
-            int relevant_bits = util::count_bits(attack_mask);
+        for (int square = 0; square < 64; square++) {
+            tables.rook_masks[square] = mask_rook_attacks(square);
+            tables.rook_offsets[square] = offset;
+            offset += 1 << rook_relevant_bits[square];
+        }
 
-            int max_occupancy_index = 1 << relevant_bits;
+        for (int square = 0; square < 64; square++) {
+            tables.bishop_masks[square] = mask_bishop_attacks(square);
+            tables.bishop_offsets[square] = offset;
+            offset += 1 << bishop_relevant_bits[square];
+        }
 
-            for (int i = 0; i < max_occupancy_index; i++) {
-                if (bishop) {
-                    U64 occupancy = set_occupancy(i, relevant_bits, attack_mask);
+        // Slider moves
+        fill_slider_attacks(tables, rook);
+        fill_slider_attacks(tables, bishop);
 
-                    int magic_index = (occupancy * bishop_magic_numbers[square] >> (64 - bishop_relevant_bits[square]));
+        // Squares between every pair of aligned squares
+        for (int square = 0; square < 64; square++) {
+            for (int other_square = 0; other_square < 64; other_square++) {
+                U64 other_bitboard = 1ULL << other_square;
 
-                    bishop_attacks[square][magic_index] = bishop_moves_on_the_fly(square, occupancy);
+                // Rays from both squares, blocked by each other, overlap exactly between them
+                if (rook_moves_on_the_fly(square, 0ULL) & other_bitboard) {
+                    tables.between[square][other_square] = rook_moves_on_the_fly(square, other_bitboard) & rook_moves_on_the_fly(other_square, 1ULL << square);
                 }
-
-                else {
-                    U64 occupancy = set_occupancy(i, relevant_bits, attack_mask);
-
-                    int magic_index = (occupancy * rook_magic_numbers[square] >> (64 - rook_relevant_bits[square]));
-
-                    rook_attacks[square][magic_index] = rook_moves_on_the_fly(square, occupancy);
+                else if (bishop_moves_on_the_fly(square, 0ULL) & other_bitboard) {
+                    tables.between[square][other_square] = bishop_moves_on_the_fly(square, other_bitboard) & bishop_moves_on_the_fly(other_square, 1ULL << square);
                 }
             }
         }
+
+        return tables;
     }
 
-    // Performs complete setup
-    void init() {
-        init_leaper_moves();
-        init_slider_moves(bishop);
-        init_slider_moves(rook);
+    /*
+        The tables are computed entirely by the compiler, so startup does no table work
+        and the tables end up in read-only memory, shared between all processes running the engine.
+    */
+    constexpr attack_tables tables = generate_attack_tables();
+
+    constexpr const U64 (&pawn_attacks)[2][64] = tables.pawn_attacks;
+    constexpr const U64 (&pawn_quiet_moves)[2][64] = tables.pawn_quiet_moves;
+    constexpr const U64 (&passed_pawn_masks)[2][64] = tables.passed_pawn_masks;
+    constexpr const U64 (&knight_moves)[64] = tables.knight_moves;
+    constexpr const U64 (&king_moves)[64] = tables.king_moves;
+    constexpr const U64 (&rook_masks)[64] = tables.rook_masks;
+    constexpr const U64 (&bishop_masks)[64] = tables.bishop_masks;
+    constexpr const int (&rook_offsets)[64] = tables.rook_offsets;
+    constexpr const int (&bishop_offsets)[64] = tables.bishop_offsets;
+    constexpr const U64 (&slider_attacks)[slider_attacks_size] = tables.slider_attacks;
+    constexpr const U64 (&between)[64][64] = tables.between;
+
+    /*
+        The following functions return the index of a slider's attacks in the packed attack array.
+
+        By default the relevant occupancy bits are hashed into an index with magic numbers.
+        When compiled with -mbmi2 -DUSE_PEXT, the PEXT instruction instead gathers the relevant
+        occupancy bits into a dense index directly, so no magic numbers are needed.
+        PEXT is only fast on Intel since Haswell and AMD since Zen 3.
+    */
+    static inline int get_bishop_index(int square, U64 occupancy) {
+#ifdef USE_PEXT
+        return bishop_offsets[square] + (int)_pext_u64(occupancy, bishop_masks[square]);
+#else
+        // Filters out squares the piece cannot move to
+        occupancy &= bishop_masks[square];
+
+        // Occupancy becomes magic index for bishop attack retrieval by using corresponding magic number
+        occupancy *= bishop_magic_numbers[square];
+        occupancy >>= 64 - bishop_relevant_bits[square];
+
+        return bishop_offsets[square] + (int)occupancy;
+#endif
+    }
+
+    static inline int get_rook_index(int square, U64 occupancy) {
+#ifdef USE_PEXT
+        return rook_offsets[square] + (int)_pext_u64(occupancy, rook_masks[square]);
+#else
+        occupancy &= rook_masks[square];
+        occupancy *= rook_magic_numbers[square];
+        occupancy >>= 64 - rook_relevant_bits[square];
+        return rook_offsets[square] + (int)occupancy;
+#endif
     }
 
     // Generates a random 64-bit number with fewer 1's
@@ -1081,24 +1847,14 @@ namespace move_gen {
     }
 
     // The following slider piece attack functions return
-    // the corresponding piece mask, using magic numbers along the way
+    // the corresponding piece mask, using magic numbers (or PEXT) along the way
     // to get relevant index for the piece attack array.
     static inline U64 get_bishop_attacks(int square, U64 occupancy) {
-        // Filters out squares the piece cannot move to
-        occupancy &= bishop_masks[square];
-
-        // Occupancy becomes magic index for bishop attack retrieval by using corresponding magic number
-        occupancy *= bishop_magic_numbers[square];
-        occupancy >>= 64 - bishop_relevant_bits[square];
-
-        return bishop_attacks[square][occupancy];
+        return slider_attacks[get_bishop_index(square, occupancy)];
     }
 
     static inline U64 get_rook_attacks(int square, U64 occupancy) {
-        occupancy &= rook_masks[square];
-        occupancy *= rook_magic_numbers[square];
-        occupancy >>= 64 - rook_relevant_bits[square];
-        return rook_attacks[square][occupancy];
+        return slider_attacks[get_rook_index(square, occupancy)];
     }
 
     static inline U64 get_queen_attacks(int square, U64 occupancy) {
@@ -1106,8 +1862,20 @@ namespace move_gen {
         return get_rook_attacks(square, occupancy) | get_bishop_attacks(square, occupancy);
     }
 
-    // Used to find out if a given square is attacked
-    static inline int is_square_attacked(int square, int side) {
+    // Returns a bitboard of all pieces of the given side attacking a square, given some occupancy
+    static inline U64 get_attackers(int square, int side, U64 occupancy) {
+        int offset = (side == white ? 0 : 6);
+
+        // A piece attacks the square exactly if the same piece type on the square would attack it
+        return (get_pawn_attacks(side ^ 1, square) & state::bitboards[P + offset]) |
+            (get_knight_moves(square) & state::bitboards[N + offset]) |
+            (get_king_moves(square) & state::bitboards[K + offset]) |
+            (get_bishop_attacks(square, occupancy) & (state::bitboards[B + offset] | state::bitboards[Q + offset])) |
+            (get_rook_attacks(square, occupancy) & (state::bitboards[R + offset] | state::bitboards[Q + offset]));
+    }
+
+    // Used to find out if a given square is attacked, given some occupancy
+    static inline int is_square_attacked(int square, int side, U64 occupancy) {
 
         // The key point is that any piece (with the exception of pawns) can reach the same square it moved from
         // A pawn of opposite color should overlap with one of the white pawns' attacks
@@ -1121,15 +1889,54 @@ namespace move_gen {
             return 1;
 
         // Sliders rely on current occupancy
-        if (move_gen::get_bishop_attacks(square, state::occupancies[both]) & ((side == white) ? state::bitboards[B] : state::bitboards[b]))
+        if (move_gen::get_bishop_attacks(square, occupancy) & ((side == white) ? state::bitboards[B] : state::bitboards[b]))
             return 1;
-        if (move_gen::get_rook_attacks(square, state::occupancies[both]) & ((side == white) ? state::bitboards[R] : state::bitboards[r]))
+        if (move_gen::get_rook_attacks(square, occupancy) & ((side == white) ? state::bitboards[R] : state::bitboards[r]))
             return 1;
-        if (move_gen::get_queen_attacks(square, state::occupancies[both]) & ((side == white) ? state::bitboards[Q] : state::bitboards[q]))
+        if (move_gen::get_queen_attacks(square, occupancy) & ((side == white) ? state::bitboards[Q] : state::bitboards[q]))
             return 1;
 
         return 0;
     }
+
+    // Used to find out if a given square is attacked on the current board
+    static inline int is_square_attacked(int square, int side) {
+        return is_square_attacked(square, side, state::occupancies[both]);
+    }
+
+    // Used to find out if a move of the side to move gives check, without making it
+    // En passant captures are always reported as checks, as the captured pawn isn't accounted for
+    static inline bool gives_check(int move) {
+        int side = state::side;
+        int offset = (side == white ? 0 : 6);
+        int king_square = util::get_ls1b(state::bitboards[side == white ? k : K]);
+        int source_square = get_source(move);
+        int target_square = get_target(move);
+
+        if (is_en_passant(move)) {
+            return true;
+        }
+
+        U64 occupancy = (state::occupancies[both] & ~(1ULL << source_square)) | (1ULL << target_square);
+        int piece_type = (get_promotion_piece_type(move) ? get_promotion_piece_type(move) : get_piece(move)) - offset;
+        U64 attacks = 0ULL;
+
+        switch (piece_type) {
+            case P: attacks = get_pawn_attacks(side, target_square); break;
+            case N: attacks = get_knight_moves(target_square); break;
+            case B: attacks = get_bishop_attacks(target_square, occupancy); break;
+            case R: attacks = get_rook_attacks(target_square, occupancy); break;
+            case Q: attacks = get_queen_attacks(target_square, occupancy); break;
+        }
+
+        // When castling, the rook lands on the square the king passed over
+        if (is_castling(move)) {
+            attacks = get_rook_attacks((source_square + target_square) / 2, occupancy);
+        }
+
+        // A direct check by the moved piece, or a discovered check by a slider behind the source square
+        return (attacks & (1ULL << king_square)) || (get_attackers(king_square, side, occupancy) & ~(1ULL << source_square));
+    }
     
     // Used to add a move to a move list
     static inline void add_move(moves *move_list, int move) {
@@ -1137,518 +1944,494 @@ namespace move_gen {
         ++move_list->size;
     }
 
-    // Used to generate all possible moves
-    static inline void generate_moves(moves *move_list) {
-        // Reset move count
-        move_list->size = 0;
+    // Adds a move from the source square to every target square, detecting captures along the way
+    static inline void add_piece_moves(moves *move_list, int piece, int source_square, U64 targets) {
+        int enemy = (piece <= K ? black : white);
 
-        // Define source & target squares
-        int source_square, target_square;
+        while (targets) {
+            int target_square = util::get_ls1b(targets);
 
-        // Define current piece's bitboard copy and its attacks
-        U64 bitboard, attacks;
+            // Quiet move
+            if (!is_occupied(state::occupancies[enemy], target_square)) {
+                add_move(move_list, encode_move(source_square, target_square, piece, 0, no_piece, 0, 0, 0));
+            }
 
-        // Generate white pawns & white king castling moves
-        if (state::side == white) {
-            bitboard = state::bitboards[P];
+            // Capture move
+            else {
+                add_move(move_list, encode_move(source_square, target_square, piece, 0, state::board[target_square], 0, 0, 0));
+            }
 
-            while (bitboard) {
-                source_square = util::get_ls1b(bitboard);
-                target_square = source_square - 8;
-
-                // Generate quiet pawn moves
-                if (!get_bit(state::occupancies[both], target_square)) {
-                    // Pawn promotion
-                    if (source_square >= a7 && source_square <= h7) {
-                        add_move(move_list, encode_move(source_square, target_square, P, Q, no_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, P, R, no_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, P, B, no_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, P, N, no_piece, 0, 0, 0));
-                    }
+            pop_bit(targets, target_square);
+        }
+    }
 
-                    else {
-                        // One square ahead pawn move
-                        add_move(move_list, encode_move(source_square, target_square, P, 0, no_piece, 0, 0, 0));
+    // Adds a pawn move, which becomes four moves if the pawn reaches the last rank
+    static inline void add_pawn_move(moves *move_list, int pawn, int source_square, int target_square, int captured_piece, bool promotion) {
+        if (promotion) {
+            add_move(move_list, encode_move(source_square, target_square, pawn, pawn + Q, captured_piece, 0, 0, 0));
+            add_move(move_list, encode_move(source_square, target_square, pawn, pawn + R, captured_piece, 0, 0, 0));
+            add_move(move_list, encode_move(source_square, target_square, pawn, pawn + B, captured_piece, 0, 0, 0));
+            add_move(move_list, encode_move(source_square, target_square, pawn, pawn + N, captured_piece, 0, 0, 0));
+        }
+        else {
+            add_move(move_list, encode_move(source_square, target_square, pawn, 0, captured_piece, 0, 0, 0));
+        }
+    }
 
-                        // Two squares ahead pawn move
-                        if ((source_square >= a2 && source_square <= h2) && !get_bit(state::occupancies[both], target_square - 8)) {
-                            add_move(move_list, encode_move(source_square, target_square - 8, P, 0, no_piece, 1, 0, 0));
-                        }
-                    }
-                }
+    // Kinds of moves to generate. Promotions count as captures, since they change material as well
+    enum {gen_all, gen_captures, gen_quiets};
 
-                // Init pawn attacks bitboard
-                attacks = get_pawn_attacks(state::side, source_square) & state::occupancies[black];
+    /*
+        Used to generate legal moves of the given kind, which are appended to the move list.
 
-                while (attacks) {
-                    target_square = util::get_ls1b(attacks);
-                    int target_piece = no_piece;
-                    int start_piece, end_piece;
-                    if (state::side == white) {
-                        start_piece = p;
-                        end_piece = k;
-                    }
-                    else {
-                        start_piece = P;
-                        end_piece = K;
-                    }
+        Instead of generating every move and testing afterwards whether it exposes the king,
+        the pieces giving check and the pinned pieces are found once, up front:
 
-                    for (int piece_type = start_piece; piece_type <= end_piece; piece_type++) {
-                        if (is_occupied(state::bitboards[piece_type], target_square)) {
-                            target_piece = piece_type;
-                            // for some reason, break makes it slower
-                            // break;
-                        }
-                    }
-                    // Pawn promotion
-                    if (source_square >= a7 && source_square <= h7) {
+        - In double check, only the king can move.
+        - In single check, other pieces must capture the checker or block the line to it (check_mask).
+        - A pinned piece may only move along the line between the king and the pinning piece (pin_rays).
+        - The king may not move to attacked squares, which are found with the king removed from the board,
+          so it cannot hide behind itself from a slider.
+        - En passant removes two pieces from a rank at once, so it is tested separately.
+    */
+    static inline void generate_moves(moves *move_list, int type) {
+        int side = state::side;
+        int enemy = side ^ 1;
 
-                        add_move(move_list, encode_move(source_square, target_square, P, Q, target_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, P, R, target_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, P, B, target_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, P, N, target_piece, 0, 0, 0));
-                    }
+        // Piece types of the side to move are found by adding the offset to the white piece types
+        int offset = (side == white ? 0 : 6);
+        int enemy_offset = 6 - offset;
 
-                    else {
-                        add_move(move_list, encode_move(source_square, target_square, P, 0, target_piece, 0, 0, 0));
-                    }
+        U64 own_pieces = state::occupancies[side];
+        U64 enemy_pieces = state::occupancies[enemy];
+        U64 occupancy = state::occupancies[both];
 
-                    // Pop ls1b of the pawn attacks
-                    pop_bit(attacks, target_square);
-                }
+        // Squares pieces may move to: enemy pieces for captures, empty squares for quiet moves
+        U64 target_mask = ~own_pieces;
+        if (type == gen_captures) target_mask = enemy_pieces;
+        if (type == gen_quiets) target_mask = ~occupancy;
 
-                // Generate en_passant captures
-                if (state::en_passant != no_sq) {
-                    // Lookup pawn attacks and bitwise AND with en_passant square (bit)
-                    U64 en_passant_attacks = get_pawn_attacks(state::side, source_square) & (1ULL << state::en_passant);
+        int king_square = util::get_ls1b(state::bitboards[K + offset]);
 
-                    // Make sure en_passant capture is available
-                    if (en_passant_attacks) {
-                        // Init en_passant capture target square
-                        int target_en_passant = util::get_ls1b(en_passant_attacks);
-                        add_move(move_list, encode_move(source_square, target_en_passant, P, 0, p, 0, 1, 0));
-                    }
-                }
+        // Pieces giving check
+        U64 checkers = get_attackers(king_square, enemy, occupancy);
 
-                // Pop ls1b from piece bitboard copy
-                pop_bit(bitboard, source_square);
-            }
+        // Generate king moves
+        U64 attacks = get_king_moves(king_square) & target_mask;
+        U64 occupancy_without_king = occupancy ^ (1ULL << king_square);
 
-            // Castling moves
-            bitboard = state::bitboards[K];
+        while (attacks) {
+            int target_square = util::get_ls1b(attacks);
 
-            // King side castling is available
-            if (state::castle & wk) {
-                // Make sure square between king and king's rook are empty
-                if (!get_bit(state::occupancies[both], f1) && !get_bit(state::occupancies[both], g1)) {
-                    // Make sure king and the f1 squares are not under attacks
-                    if (!move_gen::is_square_attacked(e1, black) && !move_gen::is_square_attacked(f1, black)) {
-                        add_move(move_list, encode_move(e1, g1, K, 0, no_piece, 0, 0, 1));
-                    }
-                }
+            if (!is_square_attacked(target_square, enemy, occupancy_without_king)) {
+                add_piece_moves(move_list, K + offset, king_square, 1ULL << target_square);
             }
 
-            // Queen side castling is available
-            if (state::castle & wq) {
-                // Make sure square between king and queen's rook are empty
-                if (!get_bit(state::occupancies[both], d1) && !get_bit(state::occupancies[both], c1) && !get_bit(state::occupancies[both], b1)) {
-                    // Make sure king and the d1 squares are not under attacks
-                    if (!move_gen::is_square_attacked(e1, black) && !move_gen::is_square_attacked(d1, black)) {
-                        add_move(move_list, encode_move(e1, c1, K, 0, no_piece, 0, 0, 1));
-                    }
-                }
-            }
+            pop_bit(attacks, target_square);
         }
 
-        // Generate black pawns & black king castling moves
-        else {
-            bitboard = state::bitboards[p];
+        // In double check, only the king can move
+        if (util::count_bits(checkers) > 1) {
+            return;
+        }
 
-            while (bitboard) {
-                source_square = util::get_ls1b(bitboard);
-
-                target_square = source_square + 8;
-
-                // Generate quiet pawn moves
-                if (!get_bit(state::occupancies[both], target_square)) {
-                    // Pawn promotion
-                    if (source_square >= a2 && source_square <= h2) {
-                        add_move(move_list, encode_move(source_square, target_square, p, q, no_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, p, r, no_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, p, b, no_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, p, n, no_piece, 0, 0, 0));
-                    }
+        // Castling moves, where the king may not be in check or pass through or land on attacked squares
+        if (!checkers && type != gen_captures) {
+            if (side == white) {
+                if ((state::castle & wk) && !is_occupied(occupancy, f1) && !is_occupied(occupancy, g1) &&
+                    !is_square_attacked(f1, black) && !is_square_attacked(g1, black)) {
+                    add_move(move_list, encode_move(e1, g1, K, 0, no_piece, 0, 0, 1));
+                }
 
-                    else {
-                        // One square ahead pawn move
-                        add_move(move_list, encode_move(source_square, target_square, p, 0, no_piece, 0, 0, 0));
+                if ((state::castle & wq) && !is_occupied(occupancy, d1) && !is_occupied(occupancy, c1) && !is_occupied(occupancy, b1) &&
+                    !is_square_attacked(d1, black) && !is_square_attacked(c1, black)) {
+                    add_move(move_list, encode_move(e1, c1, K, 0, no_piece, 0, 0, 1));
+                }
+            }
+            else {
+                if ((state::castle & bk) && !is_occupied(occupancy, f8) && !is_occupied(occupancy, g8) &&
+                    !is_square_attacked(f8, white) && !is_square_attacked(g8, white)) {
+                    add_move(move_list, encode_move(e8, g8, k, 0, no_piece, 0, 0, 1));
+                }
 
-                        // Two squares ahead pawn move
-                        if ((source_square >= a7 && source_square <= h7) && !get_bit(state::occupancies[both], target_square + 8)) {
-                            add_move(move_list, encode_move(source_square, target_square + 8, p, 0, no_piece, 1, 0, 0));
-                        }
-                    }
+                if ((state::castle & bq) && !is_occupied(occupancy, d8) && !is_occupied(occupancy, c8) && !is_occupied(occupancy, b8) &&
+                    !is_square_attacked(d8, white) && !is_square_attacked(c8, white)) {
+                    add_move(move_list, encode_move(e8, c8, k, 0, no_piece, 0, 0, 1));
                 }
+            }
+        }
 
-                // Init pawn attacks bitboard
-                attacks = get_pawn_attacks(state::side, source_square) & state::occupancies[white];
-
-                // Generate pawn captures
-                while (attacks) {
-                    target_square = util::get_ls1b(attacks);
-                    int target_piece = no_piece;
-                    int start_piece, end_piece;
-                    if (state::side == white) {
-                        start_piece = p;
-                        end_piece = k;
-                    }
-                    else {
-                        start_piece = P;
-                        end_piece = K;
-                    }
+        // Squares other pieces may move to, which in check means capturing or blocking the checker
+        U64 check_mask = ~0ULL;
+        if (checkers) {
+            check_mask = checkers | between[king_square][util::get_ls1b(checkers)];
+        }
 
-                    for (int piece_type = start_piece; piece_type <= end_piece; piece_type++) {
-                        if (is_occupied(state::bitboards[piece_type], target_square)) {
-                            target_piece = piece_type;
-                            // for some reason, break makes it slower
-                            // break;
-                        }
-                    }
+        // Enemy sliders that would attack the king if there were none of our pieces in the way
+        U64 snipers = (get_rook_attacks(king_square, enemy_pieces) & (state::bitboards[R + enemy_offset] | state::bitboards[Q + enemy_offset])) |
+            (get_bishop_attacks(king_square, enemy_pieces) & (state::bitboards[B + enemy_offset] | state::bitboards[Q + enemy_offset]));
 
-                    // Pawn promotion
-                    if (source_square >= a2 && source_square <= h2) {
-                        add_move(move_list, encode_move(source_square, target_square, p, q, target_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, p, r, target_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, p, b, target_piece, 0, 0, 0));
-                        add_move(move_list, encode_move(source_square, target_square, p, n, target_piece, 0, 0, 0));
-                    }
+        // A piece is pinned if it is the only piece between the king and a sniper
+        U64 pinned = 0ULL;
+        U64 pin_rays[64];
 
-                    else {
-                        // One square ahead pawn move
-                        add_move(move_list, encode_move(source_square, target_square, p, 0, target_piece, 0, 0, 0));
-                    }
+        while (snipers) {
+            int sniper_square = util::get_ls1b(snipers);
+            U64 blockers = between[king_square][sniper_square] & occupancy;
 
-                    pop_bit(attacks, target_square);
-                }
+            if (blockers && !(blockers & (blockers - 1)) && (blockers & own_pieces)) {
+                pinned |= blockers;
+                pin_rays[util::get_ls1b(blockers)] = between[king_square][sniper_square] | (1ULL << sniper_square);
+            }
 
-                // Generate en_passant captures
-                if (state::en_passant != no_sq) {
-                    // Lookup pawn attacks and bitwise AND with en_passant square (bit)
-                    U64 en_passant_attacks = get_pawn_attacks(state::side, source_square) & (1ULL << state::en_passant);
+            pop_bit(snipers, sniper_square);
+        }
 
-                    if (en_passant_attacks) {
-                        int target_en_passant = util::get_ls1b(en_passant_attacks);
-                        add_move(move_list, encode_move(source_square, target_en_passant, p, 0, P, 0, 1, 0));
-                    }
-                }
+        // Generate pawn moves
+        int pawn = P + offset;
+        int push_direction = (side == white ? -8 : 8);
+        U64 start_rank = (side == white ? rank_2 : rank_7);
+        U64 last_rank = (side == white ? rank_8 : rank_1);
+        U64 bitboard = state::bitboards[pawn];
 
-                pop_bit(bitboard, source_square);
+        while (bitboard) {
+            int source_square = util::get_ls1b(bitboard);
+            int target_square = source_square + push_direction;
+            bool promotion = (1ULL << target_square) & last_rank;
+
+            // Squares this pawn may legally move to, ignoring en passant
+            U64 legal_mask = check_mask;
+            if (is_occupied(pinned, source_square)) {
+                legal_mask &= pin_rays[source_square];
             }
 
-            bitboard = state::bitboards[k];
-
-            if (state::castle & bk) {
-                // Make sure square between king and king's rook are empty
-                if (!get_bit(state::occupancies[both], f8) && !get_bit(state::occupancies[both], g8)) {
-                    // Make sure king and the f8 squares are not under attacks
-                    if (!move_gen::is_square_attacked(e8, white) && !move_gen::is_square_attacked(f8, white))
-                        add_move(move_list, encode_move(e8, g8, k, 0, no_piece, 0, 0, 1));
+            // Generate quiet pawn moves, where promotions are generated along with captures
+            if (!is_occupied(occupancy, target_square) && (promotion ? type != gen_quiets : type != gen_captures)) {
+                // One square ahead pawn move
+                if (is_occupied(legal_mask, target_square)) {
+                    add_pawn_move(move_list, pawn, source_square, target_square, no_piece, promotion);
                 }
-            }
 
-            // Queen side castling is available
-            if (state::castle & bq) {
-                // Make sure square between king and queen's rook are empty
-                if (!get_bit(state::occupancies[both], d8) && !get_bit(state::occupancies[both], c8) && !get_bit(state::occupancies[both], b8)) {
-                    // Make sure king and the d8 squares are not under attacks
-                    if (!move_gen::is_square_attacked(e8, white) && !move_gen::is_square_attacked(d8, white))
-                        add_move(move_list, encode_move(e8, c8, k, 0, no_piece, 0, 0, 1));
+                // Two squares ahead pawn move
+                int double_target_square = target_square + push_direction;
+                if (is_occupied(start_rank, source_square) && !is_occupied(occupancy, double_target_square) && is_occupied(legal_mask, double_target_square)) {
+                    add_move(move_list, encode_move(source_square, double_target_square, pawn, 0, no_piece, 1, 0, 0));
                 }
             }
-        }
-
-        int piece = (state::side == white ? N : n);
-        bitboard = state::bitboards[piece];
 
-        // Loop over source squares of piece bitboard copy
-        while (bitboard)
-        {
-            source_square = util::get_ls1b(bitboard);
+            // Only quiet pawn moves are left if captures were not asked for
+            if (type == gen_quiets) {
+                pop_bit(bitboard, source_square);
+                continue;
+            }
 
-            // Init piece attacks in order to get set of target squares
-            attacks = get_knight_moves(source_square) & ((state::side == white) ? ~state::occupancies[white] : ~state::occupancies[black]);
+            // Generate pawn captures
+            attacks = get_pawn_attacks(side, source_square) & enemy_pieces & legal_mask;
 
-            while (attacks)
-            {
+            while (attacks) {
                 target_square = util::get_ls1b(attacks);
+                add_pawn_move(move_list, pawn, source_square, target_square, state::board[target_square], promotion);
+                pop_bit(attacks, target_square);
+            }
 
-                // Quiet move
-                if (!get_bit(((state::side == white) ? state::occupancies[black] : state::occupancies[white]), target_square)) {
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, no_piece, 0, 0, 0));
-                }
+            // Generate en passant captures
+            if (state::en_passant != no_sq && is_occupied(get_pawn_attacks(side, source_square), state::en_passant)) {
+                int captured_square = state::en_passant - push_direction;
+                int enemy_pawn = P + enemy_offset;
 
-                else {
-                    int target_piece = no_piece;
-                    int start_piece, end_piece;
-                    if (state::side == white) {
-                        start_piece = p;
-                        end_piece = k;
-                    }
-                    else {
-                        start_piece = P;
-                        end_piece = K;
-                    }
+                // The capture is played out on the occupancy, with the captured pawn removed temporarily
+                // so that it does not count as an attacker, to see if the king ends up attacked
+                U64 occupancy_after = occupancy ^ (1ULL << source_square) ^ (1ULL << state::en_passant) ^ (1ULL << captured_square);
 
-                    for (int piece_type = start_piece; piece_type <= end_piece; piece_type++) {
-                        if (is_occupied(state::bitboards[piece_type], target_square)) {
-                            target_piece = piece_type;
-                            // for some reason, break makes it slower
-                            // break;
-                        }
-                    }
-                    // Capture move
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, target_piece, 0, 0, 0));
+                pop_bit(state::bitboards[enemy_pawn], captured_square);
+                if (!is_square_attacked(king_square, enemy, occupancy_after)) {
+                    add_move(move_list, encode_move(source_square, state::en_passant, pawn, 0, enemy_pawn, 0, 1, 0));
                 }
-                pop_bit(attacks, target_square);
+                set_bit(state::bitboards[enemy_pawn], captured_square);
             }
 
             pop_bit(bitboard, source_square);
         }
 
-        // Generate bishop moves
-        piece = (state::side == white ? B : b);
-        bitboard = state::bitboards[piece];
+        // Generate knight, bishop, rook and queen moves
+        for (int piece = N + offset; piece <= Q + offset; piece++) {
+            bitboard = state::bitboards[piece];
 
-        while (bitboard) {
-            source_square = util::get_ls1b(bitboard);
+            while (bitboard) {
+                int source_square = util::get_ls1b(bitboard);
 
-            attacks = get_bishop_attacks(source_square, state::occupancies[both]) & ((state::side == white) ? ~state::occupancies[white] : ~state::occupancies[black]);
+                switch (piece - offset) {
+                    case N: attacks = get_knight_moves(source_square); break;
+                    case B: attacks = get_bishop_attacks(source_square, occupancy); break;
+                    case R: attacks = get_rook_attacks(source_square, occupancy); break;
+                    default: attacks = get_queen_attacks(source_square, occupancy); break;
+                }
 
-            while (attacks) {
-                target_square = util::get_ls1b(attacks);
+                attacks &= target_mask & check_mask;
 
-                // Quiet move
-                if (!get_bit(((state::side == white) ? state::occupancies[black] : state::occupancies[white]), target_square)) {
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, no_piece, 0, 0, 0));
+                if (is_occupied(pinned, source_square)) {
+                    attacks &= pin_rays[source_square];
                 }
 
-                else {
-                    int target_piece = no_piece;
-                    int start_piece, end_piece;
-                    if (state::side == white) {
-                        start_piece = p;
-                        end_piece = k;
-                    }
-                    else {
-                        start_piece = P;
-                        end_piece = K;
-                    }
-
-                    for (int piece_type = start_piece; piece_type <= end_piece; piece_type++) {
-                        if (is_occupied(state::bitboards[piece_type], target_square)) {
-                            target_piece = piece_type;
-                            // for some reason, break makes it slower
-                            // break;
-                        }
-                    }
+                add_piece_moves(move_list, piece, source_square, attacks);
 
-                    // Capture move
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, target_piece, 0, 0, 0));
-                }
-                pop_bit(attacks, target_square);
+                pop_bit(bitboard, source_square);
             }
-
-            pop_bit(bitboard, source_square);
         }
+    }
 
-        // Generate rook moves
-        piece = (state::side == white ? R : r);
-        bitboard = state::bitboards[piece];
-        while (bitboard) {
-            source_square = util::get_ls1b(bitboard);
+    // Used to generate all legal moves
+    static inline void generate_moves(moves *move_list) {
+        move_list->size = 0;
+        generate_moves(move_list, gen_all);
+    }
 
-            attacks = get_rook_attacks(source_square, state::occupancies[both]) & ((state::side == white) ? ~state::occupancies[white] : ~state::occupancies[black]);
+    // Used to append all legal captures and promotions to the move list
+    static inline void generate_captures(moves *move_list) {
+        generate_moves(move_list, gen_captures);
+    }
 
-            while (attacks) {
-                target_square = util::get_ls1b(attacks);
+    // Used to append all legal quiet moves (without promotions) to the move list
+    static inline void generate_quiets(moves *move_list) {
+        generate_moves(move_list, gen_quiets);
+    }
+}
 
-                // Quiet move
-                if (!get_bit(((state::side == white) ? state::occupancies[black] : state::occupancies[white]), target_square)) {
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, no_piece, 0, 0, 0));
-                }
+/*
+    The time_manager namespace decides how long to think about a move, given the clock.
+    The search stops between iterations once it passes the soft limit, which is scaled by how stable
+    the best move and score are. The hard limit stops it in the middle of an iteration.
+*/
+namespace time_manager {
+    // Timer started at the beginning of every search
+    Timer timer;
 
-                else {
-                    int target_piece = no_piece;
-                    int start_piece, end_piece;
-                    if (state::side == white) {
-                        start_piece = p;
-                        end_piece = k;
-                    }
-                    else {
-                        start_piece = P;
-                        end_piece = K;
-                    }
+    // Whether the search is limited by time at all, shared by all search threads and the input thread
+    std::atomic<bool> use_time(false);
 
-                    for (int piece_type = start_piece; piece_type <= end_piece; piece_type++) {
-                        if (is_occupied(state::bitboards[piece_type], target_square)) {
-                            target_piece = piece_type;
-                            // for some reason, break makes it slower
-                            // break;
-                        }
-                    }
+    // Limits in milliseconds, counted from limits_start (which is after the search starts when pondering)
+    std::atomic<double> soft_limit(std::numeric_limits<double>::infinity());
+    std::atomic<double> hard_limit(std::numeric_limits<double>::infinity());
+    std::atomic<double> limits_start(0);
 
-                    // Capture move
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, target_piece, 0, 0, 0));
-                }
-                pop_bit(attacks, target_square);
-            }
+    // With "go movetime", the search uses all of the given time
+    bool fixed_time = false;
 
-            pop_bit(bitboard, source_square);
-        }
+    // Moves assumed left until the next time control, when the GUI doesn't send movestogo
+    const int default_moves_to_go = 30;
 
-        // Generate queen moves
-        piece = (state::side == white ? Q : q);
-        bitboard = state::bitboards[piece];
-        while (bitboard) {
-            source_square = util::get_ls1b(bitboard);
+    // Time kept in reserve for the delay between the search stopping and the GUI receiving the move
+    const int move_overhead = 100;
 
-            attacks = get_queen_attacks(source_square, state::occupancies[both]) & ((state::side == white) ? ~state::occupancies[white] : ~state::occupancies[black]);
+    // Soft limit scale, indexed by the amount of iterations in a row the best move has stayed the same
+    const int max_stable_iterations = 5;
+    const double stability_scale[max_stable_iterations + 1] = {1.6, 1.3, 1.1, 1.0, 0.9, 0.8};
 
-            while (attacks) {
-                target_square = util::get_ls1b(attacks);
+    // A score that dropped by this much since the last iteration doubles the soft limit
+    const int score_drop_margin = 100;
 
-                // Quiet move
-                if (!get_bit(((state::side == white) ? state::occupancies[black] : state::occupancies[white]), target_square)) {
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, no_piece, 0, 0, 0));
-                }
+    // Information from the previous iteration
+    int previous_best_move = 0;
+    int previous_score = 0;
+    int stable_iterations = 0;
 
-                else {
-                    int target_piece = no_piece;
-                    int start_piece, end_piece;
-                    if (state::side == white) {
-                        start_piece = p;
-                        end_piece = k;
-                    }
-                    else {
-                        start_piece = P;
-                        end_piece = K;
-                    }
+    // Set when there is only one legal move, which is then played right away
+    bool single_reply = false;
 
-                    for (int piece_type = start_piece; piece_type <= end_piece; piece_type++) {
-                        if (is_occupied(state::bitboards[piece_type], target_square)) {
-                            target_piece = piece_type;
-                            // for some reason, break makes it slower
-                            // break;
-                        }
-                    }
+    // Removes the limits, so the search runs until it reaches its depth or is stopped
+    void clear_limits() {
+        use_time = false;
+        fixed_time = false;
+        soft_limit = std::numeric_limits<double>::infinity();
+        hard_limit = std::numeric_limits<double>::infinity();
+        limits_start = 0;
+    }
 
-                    // Capture move
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, target_piece, 0, 0, 0));
-                }
-                pop_bit(attacks, target_square);
-            }
+    // Sets the limits from the remaining time and increment of both sides, in milliseconds
+    // moves_to_go and opponent_time are 0 when unknown
+    void set_clock(int time, int inc, int moves_to_go, int opponent_time) {
+        clear_limits();
 
-            pop_bit(bitboard, source_square);
+        moves_to_go = (moves_to_go > 0 ? std::min(moves_to_go, default_moves_to_go) : default_moves_to_go);
+        inc = std::max(inc, 0);
+        double available = std::max(time - move_overhead, 1);
+
+        double optimum = available / moves_to_go + inc * 3 / 4;
+
+        // Some of the time advantage over the opponent is spent, and less is spent when behind
+        if (opponent_time > 0) {
+            optimum *= std::max(0.8, std::min((double)time / opponent_time, 1.25));
         }
 
-        // Generate king moves
-        piece = (state::side == white ? K : k);
-        bitboard = state::bitboards[piece];
-        while (bitboard) {
-            source_square = util::get_ls1b(bitboard);
+        // A new iteration takes longer than all previous ones together,
+        // so none is started after half of the optimum has passed
+        hard_limit = std::min(optimum * 3, available * (moves_to_go == 1 ? 0.9 : 0.5));
+        soft_limit = std::min(optimum / 2, (double)hard_limit);
+        use_time = true;
+    }
 
-            attacks = get_king_moves(source_square) & ((state::side == white) ? ~state::occupancies[white] : ~state::occupancies[black]);
+    // Sets the limit of "go movetime", in milliseconds
+    void set_move_time(int move_time) {
+        clear_limits();
 
-            while (attacks) {
-                target_square = util::get_ls1b(attacks);
+        fixed_time = true;
+        hard_limit = std::max(move_time - move_overhead, 1);
+        soft_limit = (double)hard_limit;
+        use_time = true;
+    }
 
-                // Quiet move
-                if (!get_bit(((state::side == white) ? state::occupancies[black] : state::occupancies[white]), target_square)) {
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, no_piece, 0, 0, 0));
-                }
+    // Called at the start of a search, with the amount of legal moves in the position
+    void start(int legal_moves) {
+        timer.reset();
+        previous_best_move = 0;
+        previous_score = 0;
+        stable_iterations = 0;
+        single_reply = (legal_moves == 1);
+    }
 
-                else {
-                    int target_piece = no_piece;
-                    int start_piece, end_piece;
-                    if (state::side == white) {
-                        start_piece = p;
-                        end_piece = k;
-                    }
-                    else {
-                        start_piece = P;
-                        end_piece = K;
-                    }
+    // The limits start counting now, used when pondering ends
+    void start_limits() {
+        limits_start = timer.get_time_passed_millis();
+        use_time = (hard_limit != std::numeric_limits<double>::infinity());
+    }
 
-                    for (int piece_type = start_piece; piece_type <= end_piece; piece_type++) {
-                        if (is_occupied(state::bitboards[piece_type], target_square)) {
-                            target_piece = piece_type;
-                            // for some reason, break makes it slower
-                            // break;
-                        }
-                    }
+    // Polled during the search
+    static inline bool hard_limit_reached() {
+        return use_time && timer.get_time_passed_millis() - limits_start > hard_limit;
+    }
 
-                    // Capture move
-                    add_move(move_list, encode_move(source_square, target_square, piece, 0, target_piece, 0, 0, 0));
-                }
-                pop_bit(attacks, target_square);
-            }
+    // Called after every completed iteration, decides whether to start another one
+    bool should_stop(int best_move, int score) {
+        stable_iterations = (best_move == previous_best_move ? std::min(stable_iterations + 1, max_stable_iterations) : 0);
 
-            pop_bit(bitboard, source_square);
+        // More time is spent looking for a better move when the score drops
+        double score_scale = 1.0;
+        if (previous_best_move && score < previous_score) {
+            score_scale += (double)std::min(previous_score - score, score_drop_margin) / score_drop_margin;
         }
-    }
-}
 
-// Macros for copying and reversing the current board state
-#define copy_move(move) \
-    int move_copy = (move | (state::castle << 24));
+        previous_best_move = best_move;
+        previous_score = score;
 
-#define undo_copied_move() \
-    move_exec::undo_move(move_copy)
+        if (!use_time || fixed_time) {
+            return false;
+        }
 
-#define copy_state()                                                                            \
-    U64 bitboards_copy[12], occupancies_copy[3];                                                \
-    int side_copy, en_passant_copy, castle_copy;                                                \
-    memcpy(bitboards_copy, state::bitboards, BITBOARDS_SIZE);                                   \
-    memcpy(occupancies_copy, state::occupancies, OCCUPANCIES_SIZE);                             \
-    side_copy = state::side, en_passant_copy = state::en_passant, castle_copy = state::castle;
+        if (single_reply) {
+            return true;
+        }
 
-#define revert_state()                                                                          \
-    memcpy(state::bitboards, bitboards_copy, BITBOARDS_SIZE);                                   \
-    memcpy(state::occupancies, occupancies_copy, OCCUPANCIES_SIZE);                             \
-    state::side = side_copy, state::en_passant = en_passant_copy, state::castle = castle_copy;
+        double limit = std::min(soft_limit * stability_scale[stable_iterations] * score_scale, (double)hard_limit);
+        return timer.get_time_passed_millis() - limits_start > limit;
+    }
+}
 
 /*
     The move_exec namespace contains functions and algorithms to make moves on the board
 */
 namespace move_exec {
-    // Move sorting helper arrays
-    int killer_moves[2][246];
-    int history_moves[12][246];
-    int pv_length[246];
-    int pv_table[246][246];
-    int candidate_pv_table[246][246];
+    // Maximum amount of plies from the root, quiescence search included
+    const int max_ply = 246;
+
+    // What the search keeps for every ply of the line it is currently searching
+    struct search_frame {
+        // Quiet moves that caused a beta cutoff at this ply, tried right after the captures
+        int killers[2];
+
+        // Static evaluation, only computed at frontier nodes
+        int static_eval;
+
+        // Move being searched from this ply (0 for a null move)
+        int current_move;
+
+        // Principal variation from this ply on, a slice of pv_moves
+        int *pv;
+        int pv_length;
+    };
+
+    // The search stack, kept separately by every search thread
+    thread_local search_frame search_stack[max_ply];
+
+    // The variations of all plies share a triangular array, as the variation from ply p has at most max_ply - p moves
+    thread_local int pv_moves[max_ply * (max_ply + 1) / 2];
+
+    // History of quiet moves that raised alpha, indexed by piece and target square
+    thread_local int history_moves[12][64];
+
+    // Principal variation of the last completed iteration, which the best move is taken from
+    thread_local int candidate_pv[max_ply];
+    thread_local int candidate_pv_length = 0;
 
     // The current ply depth of calculation (ply means half-move)
-    int ply = 0;
+    thread_local int ply = 0;
 
-    // Amount of nodes reached (used for time management and debugging)
-    std::uint64_t nodes = 0;
+    // Amount of nodes reached in the current iteration (used for time management and debugging)
+    thread_local std::uint64_t nodes = 0;
+
+    // Amount of nodes reached in all iterations of the current search
+    thread_local std::uint64_t search_nodes = 0;
 
     // Constant for null-move pruning
     const int reduced_depth_factor = 2;
 
-    // Timer used for time management
-    Timer timer;
-
-    // Variables used for time management
-    bool stop_calculating = false;
-    bool use_time = false;
-    double stop_time = std::numeric_limits<double>::infinity();
-    const int moves_to_go = 30;
-    const int time_offset = 100;
-
+    // Late move reductions, indexed by remaining depth and move number (both capped at 63)
+    // Later moves at higher depths are reduced more, as they are increasingly unlikely to be best
+    // https://www.chessprogramming.org/Late_Move_Reductions
+    int late_move_reductions[64][64];
+
+    // Amount of moves searched at full depth before reductions start
+    const int full_depth_moves = 3;
+
+    // Minimum remaining depth for a move to be reduced
+    const int reduction_limit = 3;
+
+    // Iterations from this depth on are searched with a window of aspiration_window around the previous score,
+    // which is widened whenever the score falls outside it
+    // https://www.chessprogramming.org/Aspiration_Windows
+    const int aspiration_depth = 4;
+    const int aspiration_window = 50;
+
+    // Bounds of the full search window
+    const int infinity = 50000;
+
+    // Margins of the pruning at frontier nodes, indexed by remaining depth
+    // https://www.chessprogramming.org/Futility_Pruning
+    // https://www.chessprogramming.org/Razoring
+    const int futility_depth = 3;
+    const int futility_margin[futility_depth + 1] = {0, 150, 300, 450};
+    const int razoring_depth = 2;
+    const int razoring_margin[razoring_depth + 1] = {0, 300, 550};
+
+    // Margin on top of a captured piece's value in delta pruning, for the positional gains of a capture
+    // https://www.chessprogramming.org/Delta_Pruning
+    const int delta_margin = 200;
+
+    // Amount of times each pruning rule cut a node or skipped a move, shown in the verbose output to tune the margins
+    thread_local std::uint64_t delta_prunes = 0;
+    thread_local std::uint64_t futility_prunes = 0;
+    thread_local std::uint64_t razoring_prunes = 0;
+
+    // Amount of threads searching, configurable with "setoption name Threads"
+    int num_threads = 1;
+    const int max_threads = 64;
+
+    // Set to stop all search threads, shared by all search threads and the input thread
+    std::atomic<bool> stop_calculating(false);
+
+    // Set while searching on the opponent's time, the best move is then held back until "ponderhit" or "stop"
+    std::atomic<bool> pondering(false);
+    // Nodes searched by a thread between looks at the clock
+    const int time_check_interval = 2048;
+    thread_local int nodes_until_time_check = time_check_interval;
+
+    // Stops the search once the hard time limit is reached
     static inline void check_if_time_is_up() {
-        if (use_time && timer.get_time_passed_millis() > stop_time) {
+        if (--nodes_until_time_check > 0) {
+            return;
+        }
+
+        nodes_until_time_check = time_check_interval;
+        if (time_manager::hard_limit_reached()) {
             stop_calculating = true;
         }
     }
@@ -1674,26 +2457,36 @@ namespace move_exec {
     }
 
     // Used to evaluate a move and give it a score
-    static inline int score_move(int move) {
+    static inline int score_move(int move, int hash_move = 0) {
 
         // Initialized to P since en passant capture
         // doesn't capture on target square
         int target_piece = P;
 
+        // The best move found in the transposition table is tried first
+        if (move == hash_move) {
+            return 20000;
+        }
+
         // Score capture move
         if (is_capture(move)) {
             return mvv_lva[get_piece(move)][get_captured_piece_type(move)] + 10000;
         }
 
+        // Score quiet promotion as if the pawn captured the piece it promotes to
+        if (get_promotion_piece_type(move)) {
+            return mvv_lva[get_piece(move)][get_promotion_piece_type(move)] + 10000;
+        }
+
         // Score quiet move (non-capture)
         else {
 
             // If move is a first priority killer move
-            if (move == killer_moves[0][ply]) {
+            if (move == search_stack[ply].killers[0]) {
                 return 9000;
             }
 
-            else if (move == killer_moves[1][ply]) {
+            else if (move == search_stack[ply].killers[1]) {
                 return 8000;
             }
         
@@ -1701,33 +2494,329 @@ namespace move_exec {
         }
     }
 
-    // Sorts moves based on their score
-    static inline void sort_moves(moves *move_list) {
-        int move_scores[move_list->size];
+    // Static exchange evaluation, the material won by a capture (or promotion) if both sides keep
+    // recapturing on the target square with their least valuable piece, as long as that pays off
+    // Sliders uncovered behind a piece that captures join in as well (x-rays)
+    // https://www.chessprogramming.org/SEE_-_The_Swap_Algorithm
+    static inline int see(int move) {
+        int source = get_source(move);
+        int target = get_target(move);
+        int promotion_piece_type = get_promotion_piece_type(move);
+
+        // Material gained by the side making each capture, assuming the exchange stops after it
+        int gain[32];
+        int depth = 0;
+
+        gain[0] = (is_capture(move) ? see_value[get_captured_piece_type(move)] : 0);
+        if (promotion_piece_type) {
+            gain[0] += see_value[promotion_piece_type] - see_value[P];
+        }
+
+        // Value of the piece standing on the target square, next in line to be captured
+        int target_value = see_value[promotion_piece_type ? promotion_piece_type : get_piece(move)];
+
+        U64 occupancy = state::occupancies[both];
+        pop_bit(occupancy, source);
+        if (is_en_passant(move)) {
+            pop_bit(occupancy, (state::side == white ? target + 8 : target - 8));
+        }
+
+        U64 bishops = state::bitboards[B] | state::bitboards[b] | state::bitboards[Q] | state::bitboards[q];
+        U64 rooks = state::bitboards[R] | state::bitboards[r] | state::bitboards[Q] | state::bitboards[q];
+        U64 attackers = (move_gen::get_attackers(target, white, occupancy) | move_gen::get_attackers(target, black, occupancy)) & occupancy;
+
+        int side = state::side ^ 1;
+
+        while (depth < 31) {
+            U64 side_attackers = attackers & state::occupancies[side];
+            if (!side_attackers) {
+                break;
+            }
+
+            // Finds the least valuable attacker
+            int attacker = (side == white ? P : p);
+            while (!(side_attackers & state::bitboards[attacker])) {
+                ++attacker;
+            }
+
+            // Once the side to capture is behind whether it captures or not, the sign of the result is settled
+            if (std::max(-gain[depth], target_value - gain[depth]) < 0) {
+                break;
+            }
+
+            ++depth;
+            gain[depth] = target_value - gain[depth - 1];
+
+            target_value = see_value[attacker];
+            pop_bit(occupancy, util::get_ls1b(side_attackers & state::bitboards[attacker]));
+
+            // Adds the sliders behind the capturing piece
+            if (attacker == P || attacker == p || attacker == B || attacker == b || attacker == Q || attacker == q) {
+                attackers |= move_gen::get_bishop_attacks(target, occupancy) & bishops;
+            }
+            if (attacker == R || attacker == r || attacker == Q || attacker == q) {
+                attackers |= move_gen::get_rook_attacks(target, occupancy) & rooks;
+            }
+            attackers &= occupancy;
+
+            side ^= 1;
+        }
+
+        // Each side only captures if that is better than stopping the exchange
+        while (depth) {
+            gain[depth - 1] = -std::max(-gain[depth - 1], gain[depth]);
+            --depth;
+        }
+
+        return gain[0];
+    }
+
+    // Whether a capture loses material, without a full exchange evaluation when the victim is worth as much as the attacker
+    static inline bool is_losing_capture(int move) {
+        if (see_value[get_captured_piece_type(move)] >= see_value[get_piece(move)]) {
+            return false;
+        }
+
+        return see(move) < 0;
+    }
+
+    // Stages of the move picker, in the order moves are tried
+    enum {stage_hash_move, stage_init_captures, stage_captures, stage_killers, stage_init_quiets, stage_quiets, stage_bad_captures, stage_done};
+
+    /*
+        The move picker hands out moves one at a time, in order of expected quality.
+        Since most cut nodes fail high on one of the first moves, the remaining moves
+        are only generated, scored and ordered once they are actually needed:
+
+        - The best move found in the transposition table
+        - Captures and promotions, picked by selection in MVV-LVA order
+        - Killer moves
+        - Remaining quiet moves, picked by selection in history order
+        - Captures that lose material according to the static exchange evaluation,
+          which were put aside when picking the captures
+
+        Captures are always generated before quiet moves, so the move list holds the captures
+        first and the quiet moves after them. Moves before "current" have been handed out,
+        moves from "current" to "end" belong to the current stage.
+    */
+    struct move_picker {
+        moves move_list[1];
+        int move_scores[256];
+        int hash_move;
+        int stage;
+        int current;
+        int end;
+        int killer_index;
+        moves bad_captures[1];
+        int bad_capture_index;
+        bool captures_only;
+        bool captures_generated;
+        bool quiets_generated;
+    };
+
+    // Prepares the picker for the current position, without generating any moves yet
+    static inline void init_picker(move_picker *picker, int hash_move, bool captures_only) {
+        picker->move_list->size = 0;
+        picker->hash_move = hash_move;
+        picker->stage = stage_hash_move;
+        picker->current = 0;
+        picker->end = 0;
+        picker->killer_index = 0;
+        picker->bad_captures->size = 0;
+        picker->bad_capture_index = 0;
+        picker->captures_only = captures_only;
+        picker->captures_generated = false;
+        picker->quiets_generated = false;
+    }
 
-        for (int i = 0; i < move_list->size; i++) {
-            move_scores[i] = score_move(move_list->array[i]);
+    // Generates the captures and promotions, unless it has already been done
+    static inline void generate_captures(move_picker *picker) {
+        if (!picker->captures_generated) {
+            move_gen::generate_captures(picker->move_list);
+            picker->captures_generated = true;
         }
+    }
+
+    // Generates the quiet moves after the captures, unless it has already been done
+    static inline void generate_quiets(move_picker *picker) {
+        generate_captures(picker);
+
+        if (!picker->quiets_generated) {
+            move_gen::generate_quiets(picker->move_list);
+            picker->quiets_generated = true;
+        }
+    }
 
-        for (int current_move = 0; current_move < move_list->size; current_move++) {
-            for (int next_move = current_move + 1; next_move < move_list->size; next_move++) {
-                if (move_scores[next_move] > move_scores[current_move]) {
-                    // swap scores
-                    int temp_score = move_scores[current_move];
-                    move_scores[current_move] = move_scores[next_move];
-                    move_scores[next_move] = temp_score;
+    // Swaps two moves (and their scores) in the picker
+    static inline void swap_moves(move_picker *picker, int i, int j) {
+        int temp_move = picker->move_list->array[i];
+        picker->move_list->array[i] = picker->move_list->array[j];
+        picker->move_list->array[j] = temp_move;
 
-                    // swap moves
-                    int temp_move = move_list->array[current_move];
-                    move_list->array[current_move] = move_list->array[next_move];
-                    move_list->array[next_move] = temp_move;
+        int temp_score = picker->move_scores[i];
+        picker->move_scores[i] = picker->move_scores[j];
+        picker->move_scores[j] = temp_score;
+    }
+
+    // Moves the move at the given index to the front of the untried moves and hands it out
+    static inline int pick(move_picker *picker, int index) {
+        swap_moves(picker, picker->current, index);
+        return picker->move_list->array[picker->current++];
+    }
+
+    // Hands out the best scored of the moves left in the current stage, or 0 if there are none
+    // The hash move has already been tried, so it is skipped
+    static inline int pick_best(move_picker *picker) {
+        while (picker->current < picker->end) {
+            int best_index = picker->current;
+
+            for (int i = picker->current + 1; i < picker->end; i++) {
+                if (picker->move_scores[i] > picker->move_scores[best_index]) {
+                    best_index = i;
                 }
             }
+
+            int move = pick(picker, best_index);
+
+            if (move != picker->hash_move) {
+                return move;
+            }
+        }
+
+        return 0;
+    }
+
+    // Returns the index of a move among the untried moves, or -1 if it is not there
+    static inline int find_move(move_picker *picker, int move) {
+        for (int i = picker->current; i < picker->move_list->size; i++) {
+            if (picker->move_list->array[i] == move) {
+                return i;
+            }
         }
+
+        return -1;
     }
 
-    // Used to undo move on the board
-    static inline void undo_move(int move) {
+    // Returns the next move to try, or 0 when there are no moves left
+    static inline int next_move(move_picker *picker) {
+        switch (picker->stage) {
+            case stage_hash_move: {
+                picker->stage = stage_init_captures;
+
+                // The hash move is only handed out if it turns out to be legal in this position
+                if (picker->hash_move) {
+                    if (is_capture(picker->hash_move) || get_promotion_piece_type(picker->hash_move)) {
+                        generate_captures(picker);
+                    }
+                    else if (!picker->captures_only) {
+                        generate_quiets(picker);
+                    }
+
+                    if (find_move(picker, picker->hash_move) != -1) {
+                        return picker->hash_move;
+                    }
+
+                    picker->hash_move = 0;
+                }
+            }
+            // Fall through
+
+            case stage_init_captures: {
+                // The captures are scored
+                generate_captures(picker);
+
+                picker->stage = stage_captures;
+                picker->end = picker->move_list->size;
+
+                // Quiet moves may already have been generated to find the hash move
+                for (int i = picker->current; i < picker->end; i++) {
+                    if (!is_capture(picker->move_list->array[i]) && !get_promotion_piece_type(picker->move_list->array[i])) {
+                        picker->end = i;
+                        break;
+                    }
+
+                    picker->move_scores[i] = score_move(picker->move_list->array[i]);
+                }
+            }
+            // Fall through
+
+            case stage_captures: {
+                int move;
+                while ((move = pick_best(picker))) {
+                    // Losing captures are tried after the quiet moves, or not at all in quiescence search
+                    if (is_capture(move) && !get_promotion_piece_type(move) && is_losing_capture(move)) {
+                        picker->bad_captures->array[picker->bad_captures->size++] = move;
+                        continue;
+                    }
+
+                    return move;
+                }
+
+                if (picker->captures_only) {
+                    picker->stage = stage_done;
+                    return 0;
+                }
+
+                picker->stage = stage_killers;
+                generate_quiets(picker);
+            }
+            // Fall through
+
+            case stage_killers: {
+                while (picker->killer_index < 2) {
+                    int killer_move = search_stack[ply].killers[picker->killer_index++];
+
+                    if (killer_move != picker->hash_move) {
+                        int index = find_move(picker, killer_move);
+
+                        if (index != -1) {
+                            return pick(picker, index);
+                        }
+                    }
+                }
+
+                picker->stage = stage_init_quiets;
+            }
+            // Fall through
+
+            case stage_init_quiets: {
+                // The remaining quiet moves are scored
+                picker->stage = stage_quiets;
+                picker->end = picker->move_list->size;
+
+                for (int i = picker->current; i < picker->end; i++) {
+                    picker->move_scores[i] = history_moves[get_piece(picker->move_list->array[i])][get_target(picker->move_list->array[i])];
+                }
+            }
+            // Fall through
+
+            case stage_quiets: {
+                int move = pick_best(picker);
+
+                if (move) {
+                    return move;
+                }
+
+                picker->stage = stage_bad_captures;
+            }
+            // Fall through
+
+            case stage_bad_captures: {
+                if (picker->bad_capture_index < picker->bad_captures->size) {
+                    return picker->bad_captures->array[picker->bad_capture_index++];
+                }
+
+                picker->stage = stage_done;
+            }
+            // Fall through
+
+            default:
+                return 0;
+        }
+    }
+
+    // Used to unmake the last move made on the board
+    static inline void unmake_move(int move) {
         state::side ^= 1;
 
         int source = get_source(move);
@@ -1741,18 +2830,20 @@ namespace move_exec {
         pop_bit(state::occupancies[state::side], target);
         set_bit(state::bitboards[piece], source);
         set_bit(state::occupancies[state::side], source);
+        state::board[source] = piece;
+        state::board[target] = no_piece;
 
         // If the move was en passant, put the captured pawn back
         if (is_en_passant(move)) {
-            state::en_passant = target;
-
             if (state::side == white) {
                 set_bit(state::bitboards[p], target + 8);
                 set_bit(state::occupancies[black], target + 8);
+                state::board[target + 8] = p;
             }
             else {
                 set_bit(state::bitboards[P], target - 8);
                 set_bit(state::occupancies[white], target - 8);
+                state::board[target - 8] = P;
             }
         }
 
@@ -1761,6 +2852,7 @@ namespace move_exec {
 
             set_bit(state::bitboards[captured_piece], target);
             set_bit(state::occupancies[state::side ^ 1], target);
+            state::board[target] = captured_piece;
         }
 
         // If move was castling, puts back the rook to the corner
@@ -1772,6 +2864,8 @@ namespace move_exec {
                     set_bit(state::occupancies[white], h1);
                     pop_bit(state::bitboards[R], f1);
                     pop_bit(state::occupancies[white], f1);
+                    state::board[h1] = R;
+                    state::board[f1] = no_piece;
                     break;
 
                 case c1:
@@ -1780,6 +2874,8 @@ namespace move_exec {
                     set_bit(state::occupancies[white], a1);
                     pop_bit(state::bitboards[R], d1);
                     pop_bit(state::occupancies[white], d1);
+                    state::board[a1] = R;
+                    state::board[d1] = no_piece;
                     break;
 
                 case g8:
@@ -1788,6 +2884,8 @@ namespace move_exec {
                     set_bit(state::occupancies[black], h8);
                     pop_bit(state::bitboards[r], f8);
                     pop_bit(state::occupancies[black], f8);
+                    state::board[h8] = r;
+                    state::board[f8] = no_piece;
                     break;
 
                 case c8:
@@ -1796,45 +2894,100 @@ namespace move_exec {
                     set_bit(state::occupancies[black], a8);
                     pop_bit(state::bitboards[r], d8);
                     pop_bit(state::occupancies[black], d8);
+                    state::board[a8] = r;
+                    state::board[d8] = no_piece;
                     break;
             }
         }
 
-        // Sets the castling state
-        state::castle = get_castle(move);
+        // Restores the rest of the state from the undo stack
+        const state::undo_info &undo = state::undo_stack[--state::undo_size];
+        state::castle = undo.castle;
+        state::en_passant = undo.en_passant;
+        state::score = undo.score;
+        state::phase = undo.phase;
+        state::halfmove_clock = undo.halfmove_clock;
+        state::hash_key = undo.hash_key;
+        state::pawn_key = undo.pawn_key;
+
+        if (state::side == black) {
+            --state::fullmove_number;
+        }
 
         // Update occupancies
         merge_occupancies();
     }
 
     // Used to make a move on the board
-    static inline int make_move(int move) {
+    // The move is assumed to be legal, as all generated moves are
+    static inline void make_move(int move) {
+        // Saves what is needed to unmake the move
+        state::undo_info &undo = state::undo_stack[state::undo_size++];
+        undo.castle = state::castle;
+        undo.en_passant = state::en_passant;
+        undo.score = state::score;
+        undo.phase = state::phase;
+        undo.halfmove_clock = state::halfmove_clock;
+        undo.hash_key = state::hash_key;
+        undo.pawn_key = state::pawn_key;
 
         // Reset the en passant square
-        state::en_passant = no_sq;
+        if (state::en_passant != no_sq) {
+            state::hash_key ^= hashing::en_passant_keys[state::en_passant];
+            state::en_passant = no_sq;
+        }
 
         int source = get_source(move);
         int target = get_target(move);
         int piece = get_piece(move);
         int promotion_piece_type = get_promotion_piece_type(move);
+        int target_piece = promotion_piece_type ? promotion_piece_type : piece;
 
-        copy_move(move);
+        // Captures and pawn moves can't be undone, so they reset the halfmove clock
+        if (piece == P || piece == p || is_capture(move)) {
+            state::halfmove_clock = 0;
+        }
+        else {
+            ++state::halfmove_clock;
+        }
 
         // Move piece
         pop_bit(state::bitboards[piece], source);
         pop_bit(state::occupancies[state::side], source);
-        set_bit(state::bitboards[promotion_piece_type ? promotion_piece_type : piece], target);
+        set_bit(state::bitboards[target_piece], target);
         set_bit(state::occupancies[state::side], target);
+        state::board[source] = no_piece;
+        state::board[target] = target_piece;
+        state::score += piece_score[target_piece][target] - piece_score[piece][source];
+        state::phase += phase_weight[target_piece] - phase_weight[piece];
+        state::hash_key ^= hashing::piece_keys[piece][source] ^ hashing::piece_keys[target_piece][target];
+
+        // Only pawn moves and pawn captures change the pawn key
+        if (piece == P || piece == p) {
+            state::pawn_key ^= hashing::piece_keys[piece][source];
+
+            if (!promotion_piece_type) {
+                state::pawn_key ^= hashing::piece_keys[piece][target];
+            }
+        }
 
         // If the move is en passant, remove the en passant-ed piece
         if (is_en_passant(move)) {
             if (state::side == white) {
                 pop_bit(state::bitboards[p], target + 8);
                 pop_bit(state::occupancies[black], target + 8);
+                state::board[target + 8] = no_piece;
+                state::score -= piece_score[p][target + 8];
+                state::hash_key ^= hashing::piece_keys[p][target + 8];
+                state::pawn_key ^= hashing::piece_keys[p][target + 8];
             }
             else {
                 pop_bit(state::bitboards[P], target - 8);
                 pop_bit(state::occupancies[white], target - 8);
+                state::board[target - 8] = no_piece;
+                state::score -= piece_score[P][target - 8];
+                state::hash_key ^= hashing::piece_keys[P][target - 8];
+                state::pawn_key ^= hashing::piece_keys[P][target - 8];
             }
         }
 
@@ -1842,11 +2995,19 @@ namespace move_exec {
         else if (is_capture(move)) {
             pop_bit(state::bitboards[get_captured_piece_type(move)], target);
             pop_bit(state::occupancies[state::side ^ 1], target);
+            state::score -= piece_score[get_captured_piece_type(move)][target];
+            state::phase -= phase_weight[get_captured_piece_type(move)];
+            state::hash_key ^= hashing::piece_keys[get_captured_piece_type(move)][target];
+
+            if (get_captured_piece_type(move) == P || get_captured_piece_type(move) == p) {
+                state::pawn_key ^= hashing::piece_keys[get_captured_piece_type(move)][target];
+            }
         }
 
         // Set en passant square if a double pawn push was made
         else if (is_double_pawn_push(move)) {
             state::side == white ? state::en_passant = target + 8 : state::en_passant = target - 8;
+            state::hash_key ^= hashing::en_passant_keys[state::en_passant];
         }
 
         // If move is castling, moves the appropriate rook
@@ -1858,6 +3019,10 @@ namespace move_exec {
                     pop_bit(state::occupancies[white], h1);
                     set_bit(state::bitboards[R], f1);
                     set_bit(state::occupancies[white], f1);
+                    state::board[h1] = no_piece;
+                    state::board[f1] = R;
+                    state::score += piece_score[R][f1] - piece_score[R][h1];
+                    state::hash_key ^= hashing::piece_keys[R][h1] ^ hashing::piece_keys[R][f1];
                     break;
 
                 case c1:
@@ -1866,6 +3031,10 @@ namespace move_exec {
                     pop_bit(state::occupancies[white], a1);
                     set_bit(state::bitboards[R], d1);
                     set_bit(state::occupancies[white], d1);
+                    state::board[a1] = no_piece;
+                    state::board[d1] = R;
+                    state::score += piece_score[R][d1] - piece_score[R][a1];
+                    state::hash_key ^= hashing::piece_keys[R][a1] ^ hashing::piece_keys[R][d1];
                     break;
 
                 case g8:
@@ -1874,6 +3043,10 @@ namespace move_exec {
                     pop_bit(state::occupancies[black], h8);
                     set_bit(state::bitboards[r], f8);
                     set_bit(state::occupancies[black], f8);
+                    state::board[h8] = no_piece;
+                    state::board[f8] = r;
+                    state::score += piece_score[r][f8] - piece_score[r][h8];
+                    state::hash_key ^= hashing::piece_keys[r][h8] ^ hashing::piece_keys[r][f8];
                     break;
 
                 case c8:
@@ -1882,33 +3055,229 @@ namespace move_exec {
                     pop_bit(state::occupancies[black], a8);
                     set_bit(state::bitboards[r], d8);
                     set_bit(state::occupancies[black], d8);
+                    state::board[a8] = no_piece;
+                    state::board[d8] = r;
+                    state::score += piece_score[r][d8] - piece_score[r][a8];
+                    state::hash_key ^= hashing::piece_keys[r][a8] ^ hashing::piece_keys[r][d8];
                     break;
             }
         }
 
         // Update castling rights
+        state::hash_key ^= hashing::castle_keys[state::castle];
         state::castle &= castling_rights[source];
         state::castle &= castling_rights[target];
+        state::hash_key ^= hashing::castle_keys[state::castle];
 
         // Update occupancies
         merge_occupancies();
 
+        if (nnue::enabled) {
+            nnue::update(move, state::side);
+        }
+
+        if (state::side == black) {
+            ++state::fullmove_number;
+        }
+
         // Switch sides
         state::side ^= 1;
+        state::hash_key ^= hashing::side_key;
+    }
+
+    // Used to pass the turn to the opponent, for null-move pruning
+    static inline void make_null_move() {
+        state::undo_info &undo = state::undo_stack[state::undo_size++];
+        undo.castle = state::castle;
+        undo.en_passant = state::en_passant;
+        undo.halfmove_clock = state::halfmove_clock;
+        undo.hash_key = state::hash_key;
+
+        // Positions before a null move are not part of the game, so they can't be repeated
+        state::halfmove_clock = 0;
+
+        if (state::en_passant != no_sq) {
+            state::hash_key ^= hashing::en_passant_keys[state::en_passant];
+            state::en_passant = no_sq;
+        }
+
+        if (nnue::enabled) {
+            nnue::update_null_move();
+        }
+
+        state::side ^= 1;
+        state::hash_key ^= hashing::side_key;
+    }
+
+    static inline void unmake_null_move() {
+        state::side ^= 1;
+
+        const state::undo_info &undo = state::undo_stack[--state::undo_size];
+        state::en_passant = undo.en_passant;
+        state::halfmove_clock = undo.halfmove_clock;
+        state::hash_key = undo.hash_key;
+    }
+
+    // Records kept at most between the moves of a game, leaving room for the moves of a search
+    const int max_history_size = state::max_undo_size - max_ply;
+
+    // Drops the records of moves before the last capture or pawn move, which repetitions can't reach back past,
+    // so long games don't outgrow the undo stack. The dropped moves can't be unmade anymore.
+    static inline void trim_history() {
+        int history_size = std::min({state::halfmove_clock, state::undo_size, max_history_size});
+        int dropped = state::undo_size - history_size;
+
+        if (dropped) {
+            memmove(state::undo_stack, state::undo_stack + dropped, history_size * sizeof(state::undo_info));
+            nnue::accumulators[history_size % nnue::accumulator_stack_size] = nnue::current_accumulator();
+            state::undo_size = history_size;
+        }
+    }
+
+    // Whether the current position occurred before, which is scored as a draw
+    // Only positions since the last capture or pawn move can be repeated, and only those with the same
+    // side to move, at least four plies back, are checked
+    static inline bool is_repetition() {
+        int oldest = std::max(state::undo_size - state::halfmove_clock, 0);
+
+        for (int i = state::undo_size - 4; i >= oldest; i -= 2) {
+            if (state::undo_stack[i].hash_key == state::hash_key) {
+                return true;
+            }
+        }
 
-        // Check that the king is not in check
-        if (move_gen::is_square_attacked((state::side == black) ? util::get_ls1b(state::bitboards[K]) : util::get_ls1b(state::bitboards[k]), state::side)) {
-            // If it is, revert back and return illegal move
-            undo_copied_move();
+        return false;
+    }
+
+    // Returns the packed score of the pawn structure from white's perspective, computing it only
+    // if the current pawn structure is not cached already, and sets the passed pawns of both sides
+    static inline int evaluate_pawns(U64 &passed_pawns) {
+        hashing::pawn_entry *pawn_entry = &hashing::pawn_table[state::pawn_key % hashing::pawn_table_size];
+
+        if (pawn_entry->key == state::pawn_key) {
+            passed_pawns = pawn_entry->passed_pawns;
+            return pawn_entry->score;
+        }
+
+        int score = 0;
+        passed_pawns = 0ULL;
+
+        for (int side = white; side <= black; side++) {
+            int pawn = (side == white ? P : p);
+            int enemy_pawn = (side == white ? p : P);
+            int sign = (side == white ? 1 : -1);
+
+            U64 bitboard_copy = state::bitboards[pawn];
+
+            while (bitboard_copy) {
+                int square = util::get_ls1b(bitboard_copy);
+                pop_bit(bitboard_copy, square);
+
+                U64 file = move_gen::file_a << (square % 8);
+                U64 adjacent_files = ((file & move_gen::not_h) << 1) | ((file & move_gen::not_a) >> 1);
+
+                // Every pawn behind another on the same file counts as doubled
+                if (state::bitboards[pawn] & file & move_gen::passed_pawn_masks[side][square]) {
+                    score += sign * doubled_pawn_score;
+                }
+
+                if (!(state::bitboards[pawn] & adjacent_files)) {
+                    score += sign * isolated_pawn_score;
+                }
+
+                if (!(move_gen::passed_pawn_masks[side][square] & state::bitboards[enemy_pawn])) {
+                    score += sign * passed_pawn_score[side == white ? 7 - square / 8 : square / 8];
+                    set_bit(passed_pawns, square);
+                }
+            }
+        }
+
+        pawn_entry->key = state::pawn_key;
+        pawn_entry->score = score;
+        pawn_entry->passed_pawns = passed_pawns;
+
+        return score;
+    }
+
+    // Returns the number of king moves between two squares
+    static inline int king_distance(int square_1, int square_2) {
+        return std::max(std::abs(square_1 % 8 - square_2 % 8), std::abs(square_1 / 8 - square_2 / 8));
+    }
+
+    // Returns the endgame score from white's perspective for kings supporting their own passed pawns
+    // and blocking the enemy ones, measured at the square in front of each passed pawn
+    static inline int passed_pawn_kings(U64 passed_pawns) {
+        int king_squares[2] = {util::get_ls1b(state::bitboards[K]), util::get_ls1b(state::bitboards[k])};
+        int score = 0;
+
+        while (passed_pawns) {
+            int square = util::get_ls1b(passed_pawns);
+            pop_bit(passed_pawns, square);
+
+            int side = (get_bit(state::bitboards[P], square) ? white : black);
+            int rank = (side == white ? 7 - square / 8 : square / 8);
+            int stop_square = square + (side == white ? -8 : 8);
+
+            int proximity = 5 * king_distance(king_squares[side ^ 1], stop_square) - 2 * king_distance(king_squares[side], stop_square);
+            score += (side == white ? 1 : -1) * passed_pawn_king_weight[rank] * proximity;
+        }
+
+        return score;
+    }
+
+    // Returns the distance from a square to the four center squares, in king moves along files and ranks
+    static inline int center_distance(int square) {
+        int file = square % 8;
+        int rank = square / 8;
+        return std::max(3 - file, file - 4) + std::max(3 - rank, rank - 4);
+    }
+
+    // Once the losing side has no pawns left, rewards driving its king to the edge and bringing
+    // the winning king closer, which is what it takes to deliver mate without pawns
+    static inline int mop_up(int eg_score) {
+        int winning_side = (eg_score > 0 ? white : black);
+
+        if (std::abs(eg_score) < mop_up_margin || state::bitboards[winning_side == white ? p : P]) {
             return 0;
         }
 
-        // Otherwise, return legal move
-        return 1;
+        int winning_king = util::get_ls1b(state::bitboards[winning_side == white ? K : k]);
+        int losing_king = util::get_ls1b(state::bitboards[winning_side == white ? k : K]);
+        int king_distance = std::abs(winning_king % 8 - losing_king % 8) + std::abs(winning_king / 8 - losing_king / 8);
+
+        int score = 10 * center_distance(losing_king) + 4 * (14 - king_distance);
+
+        return (winning_side == white ? score : -score);
+    }
+
+    // Returns whether a side has any pieces besides pawns and the king
+    static inline bool has_non_pawn_material(int side) {
+        int offset = (side == white ? 0 : 6);
+        return state::bitboards[N + offset] | state::bitboards[B + offset] | state::bitboards[R + offset] | state::bitboards[Q + offset];
+    }
+
+    // Evaluates the board state by interpolating between the middlegame and endgame scores by game phase
+    // The piece scores and phase are kept up to date by make_move, so only the pawn and king terms are computed here
+    static inline int eval() {
+        if (nnue::enabled) {
+            return nnue::evaluate(state::side);
+        }
+
+        U64 passed_pawns;
+        int score = state::score + evaluate_pawns(passed_pawns);
+        int phase = std::min(state::phase, max_phase);
+
+        int mg_score = get_mg_score(score);
+        int eg_score = get_eg_score(score) + passed_pawn_kings(passed_pawns);
+        eg_score += mop_up(eg_score);
+
+        score = (mg_score * phase + eg_score * (max_phase - phase)) / max_phase;
+
+        return (state::side == white ? score : -score);
     }
 
-    // Evaluates the board state
-    static inline int eval() {
+    // Sums the scores of all pieces on the board, used when setting up a position
+    static inline int generate_score() {
         U64 bitboard_copy;
         int square;
         int score = 0;
@@ -1923,16 +3292,25 @@ namespace move_exec {
             }
         }
 
-        return (state::side == white ? score : -score);
+        return score;
+    }
+
+    // Sums the phase weights of all pieces on the board, used when setting up a position
+    static inline int generate_phase() {
+        int phase = 0;
+
+        for (int piece_type = P; piece_type <= k; piece_type++) {
+            phase += util::count_bits(state::bitboards[piece_type]) * phase_weight[piece_type];
+        }
+
+        return phase;
     }
 
     // Performs quiescence search with alpha-beta pruning
     // https://www.chessprogramming.org/Quiescence_Search
     static inline int quiescence(int alpha, int beta) {
         // Check if command should terminate based on time spent calculating
-        if (!(nodes % 4000)) {
-            check_if_time_is_up();
-        }
+        check_if_time_is_up();
 
         ++nodes;
 
@@ -1946,28 +3324,34 @@ namespace move_exec {
             alpha = evaluation;
         }
 
-        moves move_list[1];
-        move_gen::generate_moves(move_list);
-        sort_moves(move_list);
+        // If even capturing a queen can't bring the score up to alpha, no capture can, unless a pawn is about to promote
+        U64 promoting_pawns = (state::side == white ? state::bitboards[P] & 0xff00ULL : state::bitboards[p] & 0xff000000000000ULL);
+        if (!promoting_pawns && evaluation + see_value[Q] + delta_margin <= alpha) {
+            ++delta_prunes;
+            return alpha;
+        }
 
-        for (int i = 0; i < move_list->size; i++) {
-            int current_move = move_list->array[i];
+        // Only captures are considered
+        move_picker picker[1];
+        init_picker(picker, 0, true);
 
-            copy_move(current_move);
+        int current_move;
+        while ((current_move = next_move(picker))) {
+            // Delta pruning, skips captures of pieces worth too little to bring the score up to alpha
+            if (!get_promotion_piece_type(current_move) && evaluation + see_value[get_captured_piece_type(current_move)] + delta_margin <= alpha) {
+                ++delta_prunes;
+                continue;
+            }
 
             ++ply;
 
-            // If move is illegal or not a capture
-            if (!is_capture(move_list->array[i]) || !make_move(move_list->array[i])) {
-                --ply;
-                continue;
-            }
+            make_move(current_move);
 
             // Recursively determines if capture chain is beneficial
             int score = -quiescence(-beta, -alpha);
             --ply;
 
-            undo_copied_move();
+            unmake_move(current_move);
 
             if (stop_calculating) {
                 return 0;
@@ -1988,12 +3372,35 @@ namespace move_exec {
     // Implementation of the minimax algorithm with negamax
     // https://www.chessprogramming.org/Negamax
     static inline int negamax(int alpha, int beta, int depth) {
-        pv_length[ply] = ply;
+        search_frame *frame = &search_stack[ply];
+        frame->pv_length = 0;
+
+        // Best move of this node, stored in the transposition table for move ordering
+        int best_move = 0;
+
+        // Assume the score is an upper bound until a move raises alpha
+        int hash_flag = hashing::hash_alpha;
+
+        // PV nodes are searched with an open window and are never cut off by the
+        // transposition table, so the principal variation is kept intact
+        bool pv_node = beta - alpha > 1;
+
+        // Repetitions and the fifty-move rule end the game in a draw, so the line needs no further search
+        if (ply && (state::halfmove_clock >= 100 || is_repetition())) {
+            return 0;
+        }
+
+        int score = hashing::read_entry(alpha, beta, depth, ply, &best_move);
+        if (ply && !pv_node && score != hashing::no_hash_entry) {
+            return score;
+        }
 
         if (!depth) {
             return quiescence(alpha, beta);
         }
 
+        check_if_time_is_up();
+
         ++nodes;
 
         // Note whether king is currently in check
@@ -2006,20 +3413,41 @@ namespace move_exec {
             ++depth;
         }
 
-        // Null-move pruning
+        // Frontier nodes are close enough to the horizon for the static evaluation to decide on pruning
+        bool frontier_node = !pv_node && !in_check && depth <= futility_depth && std::abs(alpha) < hashing::mate_bound;
+        frame->static_eval = (frontier_node ? eval() : 0);
+
+        // Razoring, a node far below alpha is not searched further if the captures can't bring it back either
+        if (frontier_node && depth <= razoring_depth && frame->static_eval + razoring_margin[depth] <= alpha) {
+            score = quiescence(alpha, alpha + 1);
+
+            if (stop_calculating) {
+                return 0;
+            }
+
+            if (score <= alpha) {
+                ++razoring_prunes;
+                return alpha;
+            }
+        }
+
+        // Futility pruning, quiet moves are skipped if they are unlikely to bring the score up to alpha
+        bool futility_pruning = frontier_node && frame->static_eval + futility_margin[depth] <= alpha;
+
+        // Null-move pruning, skipped when the side to move only has pawns left, where zugzwang is common,
+        // and right after another null move, which would just give the turn back
         // https://web.archive.org/web/20071031095933/http://www.brucemo.com/compchess/programming/nullmove.htm
-        if (depth >= 3 && !in_check && ply) {
-            int side_copy = state::side;
-            int en_passant_copy = state::en_passant;
+        if (depth >= 3 && !in_check && ply && search_stack[ply - 1].current_move && has_non_pawn_material(state::side)) {
+            frame->current_move = 0;
 
             // Imitates board as if it is opponent to move
-            state::side ^= 1;
-            state::en_passant = no_sq;
+            ++ply;
+            make_null_move();
 
-            int score = -negamax(-beta, -beta + 1, depth - 1 - reduced_depth_factor);
+            score = -negamax(-beta, -beta + 1, depth - 1 - reduced_depth_factor);
 
-            state::side = side_copy;
-            state::en_passant = en_passant_copy;
+            --ply;
+            unmake_null_move();
 
             if (stop_calculating) {
                 return 0;
@@ -2033,31 +3461,66 @@ namespace move_exec {
         // Keep track of the amount of legal moves
         int legal_moves = 0;
 
-        // Move list init and find all moves
-        moves move_list[1];
-        move_gen::generate_moves(move_list);
-        sort_moves(move_list);
+        // Legal moves are generated and tried in order by the move picker
+        move_picker picker[1];
+        init_picker(picker, best_move, false);
 
-        for (int i = 0; i < move_list->size; i++) {
-            int current_move = move_list->array[i];
+        int current_move;
+        while ((current_move = next_move(picker))) {
+            bool is_killer = (current_move == frame->killers[0] || current_move == frame->killers[1]);
+            frame->current_move = current_move;
 
-            copy_move(current_move);
+            ++legal_moves;
+
+            // The first move is always searched, so checkmate and stalemate are still recognized
+            // Checks are found before making the move, so pruned moves are never made
+            if (futility_pruning && legal_moves > 1 && !is_capture(current_move) && !get_promotion_piece_type(current_move) &&
+                !move_gen::gives_check(current_move)) {
+                ++futility_prunes;
+                continue;
+            }
 
             ++ply;
 
-            // If move is illegal
-            if (!make_move(current_move)) {
-                --ply;
-                continue;
+            make_move(current_move);
+
+            // The first move is searched with the full window. The rest are expected to be worse,
+            // so they are only searched with a null window around alpha, proving that they are (PVS).
+            // https://www.chessprogramming.org/Principal_Variation_Search
+            if (legal_moves == 1) {
+                score = -negamax(-beta, -alpha, depth - 1);
             }
+            else {
+                int reduction = 0;
 
-            ++legal_moves;
+                // Quiet late moves are searched at reduced depth, unless they are killers or give check
+                if (legal_moves > full_depth_moves && depth >= reduction_limit && !in_check &&
+                    !is_capture(current_move) && !get_promotion_piece_type(current_move) && !is_killer &&
+                    !move_gen::is_square_attacked(util::get_ls1b(state::bitboards[state::side == white ? K : k]), state::side ^ 1)) {
+                    reduction = late_move_reductions[std::min(depth, 63)][std::min(legal_moves, 63)];
+
+                    // PV nodes are reduced less
+                    reduction -= pv_node;
+
+                    reduction = std::max(0, std::min(reduction, depth - 2));
+                }
+
+                score = -negamax(-alpha - 1, -alpha, depth - 1 - reduction);
+
+                // A reduced move that beats alpha is searched again at full depth
+                if (reduction && score > alpha) {
+                    score = -negamax(-alpha - 1, -alpha, depth - 1);
+                }
+
+                // A move that beats alpha within the window is searched again with the full window
+                if (score > alpha && score < beta) {
+                    score = -negamax(-beta, -alpha, depth - 1);
+                }
+            }
 
-            // Update score recursively with the negamax property
-            int score = -negamax(-beta, -alpha, depth - 1);
             --ply;
 
-            undo_copied_move();
+            unmake_move(current_move);
 
             if (stop_calculating) {
                 return 0;
@@ -2067,10 +3530,12 @@ namespace move_exec {
             if (score >= beta) {
                 if (!is_capture(current_move)) {
                     // Stores killer move for current ply
-                    killer_moves[1][ply] = killer_moves[0][ply];
-                    killer_moves[0][ply] = current_move;
+                    frame->killers[1] = frame->killers[0];
+                    frame->killers[0] = current_move;
                 }
 
+                hashing::write_entry(beta, depth, hashing::hash_beta, ply, current_move);
+
                 return beta;
             }
 
@@ -2085,14 +3550,14 @@ namespace move_exec {
                 }
 
                 alpha = score;
-
-                pv_table[ply][ply] = current_move;
-
-                for (int next_ply = ply + 1; next_ply < pv_length[ply + 1]; next_ply++) {
-                    pv_table[ply][next_ply] = pv_table[ply + 1][next_ply];
-                }
-
-                pv_length[ply] = pv_length[ply + 1];
+                best_move = current_move;
+                hash_flag = hashing::hash_exact;
+
+                // The variation is the move followed by the variation of the next ply
+                search_frame *next_frame = &search_stack[ply + 1];
+                frame->pv[0] = current_move;
+                memcpy(frame->pv + 1, next_frame->pv, next_frame->pv_length * sizeof(int));
+                frame->pv_length = next_frame->pv_length + 1;
             }
         }
 
@@ -2108,69 +3573,183 @@ namespace move_exec {
             return 0;
         }
 
+        hashing::write_entry(alpha, depth, hash_flag, ply, best_move);
+
         return alpha;
     }
 
+    // Fills the late move reduction table
+    void init() {
+        for (int depth = 1; depth < 64; depth++) {
+            for (int move_count = 1; move_count < 64; move_count++) {
+                late_move_reductions[depth][move_count] = (int)(0.75 + std::log(depth) * std::log(move_count) / 2.25);
+            }
+        }
+    }
+
+    // Resets the search stack and move history of the calling thread
+    static inline void reset_helper_arrays() {
+        int *pv = pv_moves;
+        for (int frame_ply = 0; frame_ply < max_ply; frame_ply++) {
+            search_stack[frame_ply] = {{0, 0}, 0, 0, pv, 0};
+            pv += max_ply - frame_ply;
+        }
+
+        memset(history_moves, 0, sizeof(history_moves));
+    }
+
+    // Keeps the principal variation of the root as the one to take the best move from
+    static inline void save_candidate_pv() {
+        memcpy(candidate_pv, search_stack[0].pv, search_stack[0].pv_length * sizeof(int));
+        candidate_pv_length = search_stack[0].pv_length;
+    }
+
+    // Searches a copy of the root position until the main thread stops calculating
+    // Helper threads only contribute through the shared transposition table (Lazy SMP)
+    void helper_search(state::snapshot board, int depth, int thread_id) {
+        state::load(board);
+        nnue::refresh();
+        reset_helper_arrays();
+        ply = 0;
+
+        // Odd threads start one ply deeper, so the threads spread over different depths
+        for (int current_depth = 1 + (thread_id & 1); current_depth <= depth && !stop_calculating; current_depth++) {
+            negamax(-infinity, infinity, current_depth);
+        }
+    }
+
     // Function that binds everything together and looks for the best move, up to some depth
     // Takes into account time, killer moves, history moves, and the principle variation, for efficiency 
+    // The caller clears stop_calculating beforehand, so a stop that arrives before the search starts isn't lost
     void search_position(int depth) {
-        move_exec::timer.reset();
-        stop_calculating = false;
+        moves root_moves[1];
+        move_gen::generate_moves(root_moves);
+        time_manager::start(root_moves->size);
 
-        // Resets helper arrays
-        memset(killer_moves, 0, sizeof(killer_moves));
-        memset(history_moves, 0, sizeof(history_moves));
-        memset(pv_length, 0, sizeof(pv_length));
-        memset(pv_table, 0, sizeof(pv_table));
+        reset_helper_arrays();
+        search_nodes = 0;
+        delta_prunes = 0;
+        futility_prunes = 0;
+        razoring_prunes = 0;
 
-        int alpha = -50000;
-        int beta = 50000;
-        
-        copy_state();
+        int score = 0;
+
+        // Starts the helper threads on the same position
+        std::vector<std::thread> helpers;
+        for (int thread_id = 1; thread_id < num_threads; thread_id++) {
+            helpers.emplace_back(helper_search, state::save(), depth, thread_id);
+        }
 
         cout << (flags::verbose ? "\n" : "");
 
+        candidate_pv_length = 0;
+
         for (int current_depth = 1; current_depth <= depth && !stop_calculating; current_depth++) {
-            memcpy(&candidate_pv_table, &pv_table, sizeof(pv_table));
+            save_candidate_pv();
 
             nodes = 0;
 
-            int score = move_exec::negamax(alpha, beta, current_depth);
+            // Mate scores are not stable enough between iterations for a narrow window
+            bool use_aspiration = current_depth >= aspiration_depth && std::abs(score) < hashing::mate_bound;
+            int window = aspiration_window;
+            int alpha = (use_aspiration ? score - window : -infinity);
+            int beta = (use_aspiration ? score + window : infinity);
+            int re_searches = 0;
+
+            while (true) {
+                score = move_exec::negamax(alpha, beta, current_depth);
+
+                if (stop_calculating) {
+                    break;
+                }
+
+                // The score fell outside the window, so the iteration is searched again with a wider one
+                if (score <= alpha) {
+                    alpha = std::max(score - window, -infinity);
+                }
+                else if (score >= beta) {
+                    beta = std::min(score + window, infinity);
+                }
+                else {
+                    break;
+                }
+
+                window *= 2;
+                ++re_searches;
+            }
+
+            search_nodes += nodes;
             
             if (!stop_calculating) {
                 if (flags::verbose) {
-                    cout << "Found best move at depth " << current_depth << " looking through " << nodes << " nodes" << endl;
+                    cout << "Found best move at depth " << current_depth << " looking through " << nodes << " nodes (" << re_searches << " re-searches)" << endl;
                 }
                 
-                for (int i = 0; i < pv_length[0]; i++) {
-                    move_exec::make_move(pv_table[0][i]);
+                for (int i = 0; i < search_stack[0].pv_length; i++) {
+                    move_exec::make_move(search_stack[0].pv[i]);
                 }
-                int current_eval = quiescence(alpha, beta);
+                int current_eval = quiescence(-infinity, infinity);
 
                 if (flags::verbose) {
                     cout << "Evaluation: " << format::eval(current_eval) << endl;
                 }
 
-                revert_state();
+                for (int i = search_stack[0].pv_length - 1; i >= 0; i--) {
+                    move_exec::unmake_move(search_stack[0].pv[i]);
+                }
             }
             if (flags::verbose) {
                 if (stop_calculating) {
-                    cout << "Interrupted by time at depth " << current_depth << " looking through " << nodes << " nodes" << endl;
+                    cout << "Interrupted at depth " << current_depth << " looking through " << nodes << " nodes" << endl;
                 }
-                cout << "Total time passed: " << timer.get_time_passed_millis() << " milliseconds." << endl;
-                for (int i = 0; i < pv_length[0]; i++) {
-                    cout << format::move(pv_table[0][i]) << " ";
+                cout << "Total time passed: " << time_manager::timer.get_time_passed_millis() << " milliseconds." << endl;
+                for (int i = 0; i < search_stack[0].pv_length; i++) {
+                    cout << format::move(search_stack[0].pv[i]) << " ";
                 }
-                if (pv_length[0]) cout << endl;
+                if (search_stack[0].pv_length) cout << endl;
                 cout << endl;
             }
+
+            // No new iteration is started once the time manager considers the move found
+            if (!stop_calculating && time_manager::should_stop(search_stack[0].pv[0], score)) {
+                break;
+            }
+        }
+
+        // The partial result is used if the search was stopped before finishing the first iteration
+        if (!stop_calculating || !candidate_pv_length) {
+            save_candidate_pv();
+        }
+
+        // If it was stopped before finding any move, the first legal move is played
+        if (!candidate_pv_length) {
+            candidate_pv[0] = (root_moves->size ? root_moves->array[0] : 0);
+            candidate_pv_length = (root_moves->size ? 1 : 0);
+        }
+
+        // A search on the opponent's time may not report its move before the opponent has moved
+        while (pondering && !stop_calculating) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
         }
 
-        if (!stop_calculating) {
-            memcpy(&candidate_pv_table, &pv_table, sizeof(pv_table));
+        if (flags::verbose) {
+            cout << "Pruned by delta pruning: " << delta_prunes << ", futility pruning: " << futility_prunes << ", razoring: " << razoring_prunes << endl;
         }
 
-        cout << "bestmove " << format::move(candidate_pv_table[0][0]) << endl << (flags::verbose ? "\n" : "");
+        // The main thread is done, so the helper threads are told to stop as well
+        stop_calculating = true;
+        for (std::thread &helper : helpers) {
+            helper.join();
+        }
+    }
+
+    // Reports the move found by the last search to the GUI
+    void print_best_move() {
+        // The expected reply is suggested for pondering
+        string ponder_move = (candidate_pv_length > 1 ? " ponder " + format::trimmed_move(candidate_pv[1]) : "");
+
+        // Written at once, so it isn't interleaved with replies from the input thread
+        cout << "bestmove " + format::trimmed_move(candidate_pv[0]) + ponder_move + "\n" + (flags::verbose ? "\n" : "") << std::flush;
     }
 }
 
@@ -2180,10 +3759,14 @@ namespace move_exec {
 namespace parse {
     void fen(string fen) {
         memset(state::bitboards, 0ULL, BITBOARDS_SIZE);
+        memset(state::board, no_piece, sizeof(state::board));
 
         state::side = 0;
         state::en_passant = no_sq;
         state::castle = 0;
+        state::halfmove_clock = 0;
+        state::fullmove_number = 1;
+        state::undo_size = 0;
 
         int i = 0;
         int square;
@@ -2194,6 +3777,7 @@ namespace parse {
 
                 if ((fen[i] >= 'A' && fen[i] <= 'Z') || (fen[i] >= 'a' && fen[i] <= 'z')) {
                     set_bit(state::bitboards[char_pieces[fen[i]]], square);
+                    state::board[square] = char_pieces[fen[i]];
                 }
 
                 else if (fen[i] >= '0' && fen[i] <= '9') {
@@ -2255,7 +3839,19 @@ namespace parse {
             state::en_passant = no_sq;
         }
 
+        // The halfmove clock and fullmove number are optional
+        std::stringstream counters(fen.substr(std::min(i + 1, (int)fen.size())));
+        counters >> state::halfmove_clock >> state::fullmove_number;
+        state::fullmove_number = std::max(state::fullmove_number, 1);
+
         move_exec::populate_occupancies();
+
+        state::score = move_exec::generate_score();
+        state::phase = move_exec::generate_phase();
+        state::hash_key = hashing::generate_key();
+        state::pawn_key = hashing::generate_pawn_key();
+
+        nnue::refresh();
     }
 }
 
@@ -2336,14 +3932,8 @@ namespace print {
                     cout << "  " << 8 - rank << " ";
                 }
 
-                int piece = -1;
-                for(int i = 0; i < 12; i++) {
-                    if (is_occupied(state::bitboards[i], square)) {
-                        piece = i;
-                        break;
-                    }
-                }
-                cout << " " << (piece == -1 ? "." : ascii_pieces[piece]);
+                int piece = state::board[square];
+                cout << " " << (piece == no_piece ? "." : ascii_pieces[piece]);
             }
             cout << endl;
         }
@@ -2366,60 +3956,159 @@ namespace perft {
     // Amount of reached nodes
     std::uint64_t nodes = 0;
 
+    // Optional hash table caching node counts of (position, depth) pairs.
+    // Like the transposition table, it is shared between threads without locking,
+    // with the key stored XOR'ed with the data word (count << 8 | depth).
+    struct entry {
+        std::atomic<U64> key;
+        std::atomic<U64> data;
+    };
+
+    entry *table = nullptr;
+    U64 table_size = 0;
+
+    // A unit of work, being a legal reply to one of the legal root moves
+    struct task {
+        int root_index;
+        int move;
+    };
+
+    // Allocates the perft hash table, or frees it if 0 megabytes are requested
+    void resize_table(int megabytes) {
+        delete[] table;
+        table = nullptr;
+        table_size = 0;
+
+        if (megabytes > 0) {
+            table_size = (U64)std::min(megabytes, hashing::max_hash_size) * 1024 * 1024 / sizeof(entry);
+            table = new entry[table_size];
+
+            for (U64 i = 0; i < table_size; i++) {
+                table[i].key.store(0ULL, std::memory_order_relaxed);
+                table[i].data.store(0ULL, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Positions are stored at different slots depending on the remaining depth
+    static inline entry *get_entry(int depth) {
+        return &table[(state::hash_key ^ (depth * 0x9e3779b97f4a7c15ULL)) % table_size];
+    }
+
     // Recursive function to test how many possible positions exist
-    static inline void driver(int depth) {
+    static inline U64 driver(int depth) {
         if (!depth) {
-            nodes++;
-            return;
+            return 1;
+        }
+
+        if (table) {
+            entry *hash_entry = get_entry(depth);
+            U64 data = hash_entry->data.load(std::memory_order_relaxed);
+
+            if ((hash_entry->key.load(std::memory_order_relaxed) ^ data) == state::hash_key && (int)(data & 0xff) == depth) {
+                return data >> 8;
+            }
         }
 
+        U64 count = 0;
+
         moves move_list[1];
         move_gen::generate_moves(move_list);
 
         for (int move_count = 0; move_count < move_list->size; move_count++) {
             int current_move = move_list->array[move_count];
 
-            // Preserve board state
-            copy_move(current_move);
-            
-            // Makes move and skips if illegal
-            if (!move_exec::make_move(current_move)) continue;
+            move_exec::make_move(current_move);
 
             // Recursively calls itself with current position
-            driver(depth-1);
+            count += driver(depth - 1);
 
             // Retrieves the previous position
-            undo_copied_move();
+            move_exec::unmake_move(current_move);
+        }
+
+        if (table) {
+            U64 data = (count << 8) | depth;
+            entry *hash_entry = get_entry(depth);
+            hash_entry->key.store(state::hash_key ^ data, std::memory_order_relaxed);
+            hash_entry->data.store(data, std::memory_order_relaxed);
+        }
+
+        return count;
+    }
+
+    // Returns the legal moves of the current position
+    std::vector<int> legal_moves() {
+        moves move_list[1];
+        move_gen::generate_moves(move_list);
+
+        return std::vector<int>(move_list->array, move_list->array + move_list->size);
+    }
+
+    // Takes tasks from the shared list until there are none left.
+    // Every thread takes the next untaken task, so threads that finish
+    // their subtrees early keep taking work from the slower ones.
+    void worker(state::snapshot board, int depth, const std::vector<int> *root_moves, const std::vector<task> *tasks, std::atomic<int> *next_task, std::atomic<U64> *root_nodes) {
+        state::load(board);
+        nnue::refresh();
+
+        for (int i = next_task->fetch_add(1); i < (int)tasks->size(); i = next_task->fetch_add(1)) {
+            const task &current_task = (*tasks)[i];
+
+            move_exec::make_move((*root_moves)[current_task.root_index]);
+            move_exec::make_move(current_task.move);
+
+            root_nodes[current_task.root_index] += driver(depth - 2);
+
+            move_exec::unmake_move(current_task.move);
+            move_exec::unmake_move((*root_moves)[current_task.root_index]);
         }
     }
 
     // Essentially an outer layer of the driver function to display test information.
-    void test(int depth) {
+    // The subtrees of all second-ply moves are spread over the given amount of threads.
+    void test(int depth, int num_threads = 1) {
         nodes = 0;
 
         cout << "\n     Performance test\n\n";
         
-        moves move_list[1];
-        move_gen::generate_moves(move_list);
-        
         Timer timer;
 
-        for (int move_count = 0; move_count < move_list->size; move_count++) {
-            int current_move = move_list->array[move_count];
+        std::vector<int> root_moves = legal_moves();
+        std::vector<std::atomic<U64>> root_nodes(root_moves.size());
+        std::vector<task> tasks;
 
-            copy_move(current_move);
-            
-            if (!move_exec::make_move(current_move)) continue;
-            
-            long cumulative_nodes = nodes;
-            
-            driver(depth - 1);
-            
-            long old_nodes = nodes - cumulative_nodes;
-            
-            undo_copied_move();
-            
-            cout << "     move: " << format::move(current_move) << "  nodes: " << old_nodes << endl;
+        for (int root_index = 0; root_index < (int)root_moves.size(); root_index++) {
+            root_nodes[root_index] = (depth == 1);
+
+            if (depth < 2) continue;
+
+            move_exec::make_move(root_moves[root_index]);
+
+            for (int reply : legal_moves()) {
+                tasks.push_back({root_index, reply});
+            }
+
+            move_exec::unmake_move(root_moves[root_index]);
+        }
+
+        std::atomic<int> next_task(0);
+
+        // The calling thread works as well, so only num_threads - 1 threads are started
+        std::vector<std::thread> workers;
+        for (int thread_id = 1; thread_id < num_threads; thread_id++) {
+            workers.emplace_back(worker, state::save(), depth, &root_moves, &tasks, &next_task, root_nodes.data());
+        }
+
+        worker(state::save(), depth, &root_moves, &tasks, &next_task, root_nodes.data());
+
+        for (std::thread &thread : workers) {
+            thread.join();
+        }
+
+        for (int root_index = 0; root_index < (int)root_moves.size(); root_index++) {
+            nodes += root_nodes[root_index];
+            cout << "     move: " << format::move(root_moves[root_index]) << "  nodes: " << root_nodes[root_index] << endl;
         }
         
         cout << "\n    Depth: " << depth;
@@ -2428,10 +4117,127 @@ namespace perft {
     }
 }
 
+/*
+    The bench namespace searches a fixed suite of positions to a fixed depth, as a reproducible speed measurement.
+    The search is single-threaded and starts from an empty transposition table for every position,
+    so the total amount of nodes is a signature of the search behavior that only changes with the search itself.
+*/
+namespace bench {
+    const int default_depth = 10;
+
+    const string positions[] = {
+        start_position,
+        tricky_position,
+        killer_position,
+        cmk_position,
+        rook_position,
+        promotion_position,
+        "r3k2r/2pb1ppp/2pp1q2/p7/1nP1B3/1P2P3/P2N1PPP/R2QK2R w KQkq a6 0 14",
+        "4rrk1/2p1b1p1/p1p3q1/4p3/2P2n1p/1P1NR2P/PB3PP1/3R1QK1 b - - 2 24",
+        "2rr3k/pp3pp1/1nnqbN1p/3pN3/2pP4/2P3Q1/PPB4P/R4RK1 w - - 0 1",
+        "8/8/1p1k2p1/p1prp2p/P2n3P/6P1/1P1R1PK1/4R3 b - - 5 49",
+        "8/7p/5k2/5p2/p1p2P2/Pr1pPK2/1P1R3P/8 b - - 0 1",
+        "8/3p4/p1bk3p/Pp6/1Kp1PpPp/2P2P1P/2P5/5B2 b - - 0 1"
+    };
+
+    void run(int depth) {
+        // The position and settings are restored afterwards
+        state::snapshot *board = new state::snapshot(state::save());
+        int hash_size = (int)((hashing::table_size * sizeof(hashing::entry) + 1024 * 1024 - 1) / (1024 * 1024));
+        int num_threads = move_exec::num_threads;
+
+        move_exec::num_threads = 1;
+        move_exec::pondering = false;
+        hashing::resize_table(hashing::default_hash_size);
+        time_manager::clear_limits();
+
+        int num_positions = sizeof(positions) / sizeof(positions[0]);
+        std::uint64_t total_nodes = 0;
+        Timer timer;
+
+        for (int i = 0; i < num_positions; i++) {
+            cout << "\nPosition " << i + 1 << "/" << num_positions << ": " << positions[i] << endl;
+
+            parse::fen(positions[i]);
+            hashing::clear_table();
+            move_exec::stop_calculating = false;
+            move_exec::search_position(depth);
+
+            cout << "    Nodes: " << move_exec::search_nodes << endl;
+            total_nodes += move_exec::search_nodes;
+        }
+
+        double time = std::max(timer.get_time_passed_millis(), 1.0);
+
+        cout << "\n    Depth: " << depth;
+        cout << "\n    Nodes: " << total_nodes;
+        cout << "\n     Time: " << time << " milliseconds";
+        cout << "\n      NPS: " << (std::uint64_t)(total_nodes * 1000 / time) << endl;
+
+        move_exec::num_threads = num_threads;
+        hashing::resize_table(hash_size);
+        state::load(*board);
+        nnue::refresh();
+        delete board;
+    }
+}
+
 /*
     The uci namespace contains functions that implement the universal chess interface.
 */
 namespace uci {
+    // The search runs on its own thread, so the input thread can answer "isready" and "stop" while it thinks
+    std::thread search_thread;
+
+    // Whether the running search was started by "go infinite" without a depth
+    bool infinite_search = false;
+
+    // Entry point of the search thread, which searches its own copy of the position
+    void search(state::snapshot board, int depth) {
+        state::load(board);
+        nnue::refresh();
+        move_exec::search_position(depth);
+        move_exec::print_best_move();
+    }
+
+    // Waits for the running search, if any, to finish by itself
+    void wait_for_search() {
+        if (search_thread.joinable()) {
+            search_thread.join();
+        }
+    }
+
+    // Stops the running search, if any, which still prints its best move
+    void stop_search() {
+        move_exec::pondering = false;
+        move_exec::stop_calculating = true;
+        wait_for_search();
+    }
+
+    // Lets the running search, if any, finish before the next command is handled
+    // Infinite and pondering searches never end by themselves, so those are stopped instead
+    void finish_search() {
+        if (infinite_search || move_exec::pondering) {
+            stop_search();
+        }
+        else {
+            wait_for_search();
+        }
+    }
+
+    // The opponent played the expected move, so the search continues on the engine's own time
+    void ponder_hit() {
+        time_manager::start_limits();
+        move_exec::pondering = false;
+    }
+
+    // Starts searching the current position in the background
+    void start_search(int depth) {
+        wait_for_search();
+        move_exec::stop_calculating = false;
+        search_thread = std::thread(search, state::save(), depth);
+    }
+
     int parse_move(string move_string) {
         int source_square = move_string[0] - 'a' + (8 - (move_string[1] - '0')) * 8;
         int target_square = move_string[2] - 'a' + (8 - (move_string[3] - '0')) * 8;
@@ -2502,14 +4308,21 @@ namespace uci {
         }
 
         for (const string &str : substrings) {
-            if (parse_move(str))
+            if (parse_move(str)) {
                 move_exec::make_move(parse_move(str));
+                move_exec::trim_history();
+            }
         }
     }
 
     void print_engine_info() {
         cout << "id name JuulesPlusPlus" << endl;
         cout << "id author Juules32" << endl;
+        cout << "option name Hash type spin default " << hashing::default_hash_size << " min 1 max " << hashing::max_hash_size << endl;
+        cout << "option name Threads type spin default 1 min 1 max " << move_exec::max_threads << endl;
+        cout << "option name EvalFile type string default <empty>" << endl;
+        cout << "option name UseNNUE type check default false" << endl;
+        cout << "option name Ponder type check default false" << endl;
         cout << "uciok" << endl;
     }
 
@@ -2579,17 +4392,31 @@ namespace uci {
             size_t btime_i = input.find("btime");
             size_t winc_i = input.find("winc");
             size_t binc_i = input.find("binc");
+            size_t movestogo_i = input.find("movestogo");
+            size_t movetime_i = input.find("movetime");
+            size_t infinite_i = input.find("infinite");
+            size_t ponder_i = input.find("ponder");
             int depth = 6;
             int inc = -1;
             int time = -1;
-            move_exec::use_time = false;
-            move_exec::stop_time = std::numeric_limits<double>::infinity();
+            int opponent_time = 0;
+            int moves_to_go = 0;
+            time_manager::clear_limits();
+            move_exec::pondering = false;
+
+            if (perft_i != string::npos && depth_i == string::npos) {
+                // Optionally "threads <amount>" and "hash <megabytes>" can follow the depth
+                size_t threads_i = input.find("threads");
+                size_t hash_i = input.find("hash");
+
+                int threads = move_exec::num_threads;
+                if (threads_i != string::npos) {
+                    threads = std::max(1, std::min(stoi(input.substr(threads_i + 8)), move_exec::max_threads));
+                }
 
-            if (depth_i != string::npos) {
-                depth = stoi(input.substr(depth_i + 6));
-            }
-            else if (perft_i != string::npos) {
-                perft::test(stoi(input.substr(perft_i + 6)));
+                perft::resize_table(hash_i != string::npos ? stoi(input.substr(hash_i + 5)) : 0);
+                perft::test(stoi(input.substr(perft_i + 6)), threads);
+                perft::resize_table(0);
                 return;
             }
 
@@ -2599,49 +4426,139 @@ namespace uci {
             if (btime_i != string::npos && state::side == black) {
                 time = stoi(input.substr(btime_i + 6));
             }
+            if (wtime_i != string::npos && state::side == black) {
+                opponent_time = stoi(input.substr(wtime_i + 6));
+            }
+            if (btime_i != string::npos && state::side == white) {
+                opponent_time = stoi(input.substr(btime_i + 6));
+            }
             if (winc_i != string::npos && state::side == white) {
                 inc = stoi(input.substr(winc_i + 5));
             }
             if (binc_i != string::npos && state::side == black) {
                 inc = stoi(input.substr(binc_i + 5));
             }
+            if (movestogo_i != string::npos) {
+                moves_to_go = stoi(input.substr(movestogo_i + 10));
+            }
+
+            if (movetime_i != string::npos) {
+                time_manager::set_move_time(stoi(input.substr(movetime_i + 9)));
+            }
+            else if (time != -1) {
+                time_manager::set_clock(time, inc, moves_to_go, opponent_time);
+            }
 
-            if (time != -1) {
-                move_exec::use_time = true;
+            // Without a depth, searches with a time limit or on the opponent's time go on until they are stopped
+            if (depth_i != string::npos) {
+                depth = stoi(input.substr(depth_i + 6));
+            }
+            else if (time_manager::use_time || infinite_i != string::npos || ponder_i != string::npos) {
+                depth = 64;
+            }
 
-                // - 100 is a small offset to counteract the
-                // inevitable delay after stop_time is set to true
-                move_exec::stop_time = time / move_exec::moves_to_go - move_exec::time_offset + inc;
+            infinite_search = (infinite_i != string::npos && depth_i == string::npos);
 
-                move_exec::search_position(64);
+            // Pondering searches on the opponent's time, so the time limits only start to count from "ponderhit"
+            if (ponder_i != string::npos) {
+                time_manager::use_time = false;
+                move_exec::pondering = true;
             }
 
-            else {
-                move_exec::search_position(depth);
+            start_search(depth);
+        }
+    }
+
+    void parse_option(string input) {
+        size_t setoption_i = input.find("setoption");
+
+        if (setoption_i != string::npos) {
+            size_t name_i = input.find("name");
+            size_t value_i = input.find("value");
+
+            if (name_i == string::npos || value_i == string::npos) {
+                return;
+            }
+
+            string name = input.substr(name_i + 5, value_i - name_i - 6);
+            string value = input.substr(value_i + 6);
+
+            if (name == "Hash") {
+                hashing::resize_table(stoi(value));
+            }
+            else if (name == "Threads") {
+                move_exec::num_threads = std::max(1, std::min(stoi(value), move_exec::max_threads));
+            }
+            else if (name == "EvalFile") {
+                if (!nnue::load(value)) {
+                    cout << "info string Could not load network from " << value << endl;
+                }
+            }
+            else if (name == "UseNNUE") {
+                nnue::enabled = (value == "true" && nnue::loaded);
+                nnue::refresh();
+
+                if (value == "true" && !nnue::loaded) {
+                    cout << "info string No network loaded, set EvalFile first" << endl;
+                }
             }
         }
     }
 
     // Function that keeps the program running to take commands
+    // Runs on the input thread, while searches run on the search thread
     void loop() {
         string input;
         while (true) {
-            getline(cin, input);
+            // At the end of input, the running search is allowed to finish before quitting,
+            // unless it would never finish
+            if (!getline(cin, input)) {
+                finish_search();
+                break;
+            }
             
             if (input == "quit" || input == "exit") {
+                stop_search();
                 break;
             }
 
-            else if (input == "uci") {
-                print_engine_info();
+            else if (input == "stop") {
+                stop_search();
+                continue;
             }
 
+            // Answered right away, even while searching
             else if (input == "isready") {
-                cout << "readyok" << endl;
+                cout << "readyok\n" << std::flush;
+                continue;
+            }
+
+            else if (input == "ponderhit") {
+                ponder_hit();
+                continue;
+            }
+
+            // Any other command waits for the running search to finish, or stops it if it never would
+            finish_search();
+
+            if (input == "uci") {
+                print_engine_info();
             }
 
             else if (input == "ucinewgame") {
                 parse_position("position startpos");
+                hashing::clear_table();
+            }
+
+            else if (input.find("setoption") == 0) {
+                parse_option(input);
+                continue;
+            }
+
+            // Optionally followed by the depth
+            else if (input.find("bench") == 0) {
+                bench::run(input.size() > 6 ? stoi(input.substr(6)) : bench::default_depth);
+                continue;
             }
 
             parse_position(input);
@@ -2651,14 +4568,22 @@ namespace uci {
 
     void init() {
         print_engine_info();
+
+        // Searching starts from the initial position until a position command is given,
+        // since move generation assumes both kings are on the board
+        parse::fen(start_position);
         loop();
     }
 }
 
 int main(int argc, char* argv[]) {
     flags::init(argc, argv);
-    move_gen::init();
-    if (flags::debug) {
+    hashing::init();
+    move_exec::init();
+    if (flags::bench) {
+        bench::run(bench::default_depth);
+    }
+    else if (flags::debug) {
         // Put any debugging code here
     }
     else {
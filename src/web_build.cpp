@@ -1,7 +1,8 @@
 #include "main.cpp"
 
 extern "C" const char* setup() {
-    move_gen::init();
+    hashing::init();
+    move_exec::init();
     parse::fen(start_position);
     return format::game_fen().c_str();
 }
@@ -11,12 +12,13 @@ extern "C" void print_game() {
 }
 
 extern "C" const char* engine_move(int time, int inc) {
-    move_exec::use_time = true;
-    move_exec::stop_time = time / move_exec::moves_to_go - move_exec::time_offset + inc;
+    time_manager::set_clock(time, inc, 0, 0);
+    move_exec::stop_calculating = false;
     move_exec::search_position(64);
 
-    int move = move_exec::candidate_pv_table[0][0];
+    int move = move_exec::candidate_pv[0];
     move_exec::make_move(move);
+    move_exec::trim_history();
     
     print_game();
     return format::game_fen().c_str();
@@ -27,8 +29,6 @@ extern "C" U64 valid_targets(int player_source, int player_side) {
 
     moves move_list[1];
     move_gen::generate_moves(move_list);
-
-    copy_state();
     
     for (size_t i = 0; i < move_list->size; i++) {
         int current_move = move_list->array[i];
@@ -36,10 +36,7 @@ extern "C" U64 valid_targets(int player_source, int player_side) {
         int piece = get_piece(current_move);
         int side = (piece >= P && piece <= K) ? white : black;
         if (source == player_source && (side == player_side || player_side == both)) {
-            if (move_exec::make_move(current_move)) {
-                set_bit(result, get_target(current_move));
-            }
-            revert_state();
+            set_bit(result, get_target(current_move));
         }
     }
 
@@ -64,7 +61,8 @@ extern "C" int valid_move(int player_source, int player_target, int player_side)
 }
 
 extern "C" const char* make_move(int move) {
-    int success = move_exec::make_move(move);
+    move_exec::make_move(move);
+    move_exec::trim_history();
     print_game();
     return format::game_fen().c_str();
 }
@@ -77,16 +75,6 @@ extern "C" int is_checkmate() {
     moves move_list[1];
     move_gen::generate_moves(move_list);
 
-    copy_state();
-    
-    for (size_t i = 0; i < move_list->size; i++) {
-        int current_move = move_list->array[i];
-        if (move_exec::make_move(current_move)) {
-            revert_state();
-            return 0;
-        }
-        revert_state();
-    }
-
-    return 1;
+    // Only legal moves are generated, so any move means the game goes on
+    return move_list->size == 0;
 }